@@ -1,21 +1,41 @@
-#include <ctype.h>
+/* ciopfs never calls setlocale(3), in the C locale only [A-Z] are upper case */
+#define ascii_isupper(c) ((c) >= 'A' && (c) <= 'Z')
 
-static inline bool str_contains_upper(const char *s)
+static bool ascii_is_folded(const char *s)
 {
-	while (*s) {
-		if (isupper(*s++))
-			return true;
+	for (; *s; s++) {
+		if (ascii_isupper(*s))
+			return false;
 	}
-	return false;
+	return true;
 }
 
-static inline char *str_fold(const char *src)
+static size_t ascii_fold(const char *src, char *dest, size_t size, int *flags)
 {
-	char *t, *dest = malloc(strlen(src) + 1);
-	if (!dest)
-		return NULL;
-	for (t = dest; *src; src++, t++)
-		*t = tolower(*src);
-	*t = '\0';
-	return dest;
+	size_t i, len = strlen(src);
+	int f = 0;
+	bool store = len < size;
+	for (i = 0; i < len; i++) {
+		char c = src[i];
+		if (ascii_isupper(c)) {
+			f = FOLD_UPPER | FOLD_CHANGED;
+			if (!store)
+				break;
+			c += 'a' - 'A';
+		}
+		if (store)
+			dest[i] = c;
+	}
+	if (store)
+		dest[len] = '\0';
+	if (flags)
+		*flags = f;
+	return len;
 }
+
+/* without unicode support names are treated as byte strings */
+static const struct fold_ops ascii_fold_ops = {
+	.name		= "ascii",
+	.is_folded	= ascii_is_folded,
+	.fold		= ascii_fold,
+};
@@ -33,6 +33,10 @@
  * 	Otherwise disable it in config.mk, the file system will
  * 	only work with ascii [a-zA-Z] file names.
  *
+ * 	The case folding policy is selected at mount time with
+ * 	the `-o fold=' option, ascii is always available while
+ * 	simple and full depend on the configured libraries.
+ *
  * Compile & Install:
  * 	$EDITOR config.mk
  * 	make
@@ -45,9 +49,11 @@
 
 #ifdef __linux__
 #define _XOPEN_SOURCE 500 /* For pread()/pwrite() */
+#define _GNU_SOURCE /* for syncfs() */
 #endif
 
 #define _BSD_SOURCE /* for vsyslog() */
+#define _ATFILE_SOURCE /* for utimensat() */
 
 #include <fuse.h>
 #include <ulockmgr.h>
@@ -57,6 +63,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
@@ -65,6 +73,16 @@
 #include <limits.h>
 #include <syslog.h>
 #include <grp.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <glob.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 
 #if __GNUC__ >= 3
 # define likely(x)       __builtin_expect(!!(x), 1)
@@ -74,19 +92,46 @@
 # define unlikely(x)     (x)
 #endif
 
-/* each *.c file implements the following two functions:
+/* Case folding policies are implemented by the following operations:
+ *
+ * is_folded checks whether s is equal to its folded form and returns
+ * as soon as the first character which changes is encountered.
  *
- * static inline bool str_contains_upper(const char *s);
- * static inline char *str_fold(const char *s);
+ * fold works like snprintf(3): it stores the NUL terminated folded form
+ * of s in dest if it fits into size bytes and returns its length excluding
+ * the NUL byte. (size_t)-1 is returned upon error. dest may be NULL if
+ * size is zero. If flags is non NULL it is set to a combination of the
+ * FOLD_* values gathered while folding.
+ *
+ * is_nfc performs a quick check whether s is in unicode normalization
+ * form C, it may return false for strings which turn out to be unchanged
+ * by nfc. nfc follows the conventions of fold. Both are NULL if the
+ * policy has no notion of unicode.
+ */
+struct fold_ops {
+	const char *name;
+	bool (*is_folded)(const char *s);
+	size_t (*fold)(const char *s, char *dest, size_t size, int *flags);
+	bool (*is_nfc)(const char *s);
+	size_t (*nfc)(const char *s, char *dest, size_t size);
+};
+
+#define FOLD_UPPER   (1 << 0) /* s contains upper case characters */
+#define FOLD_CHANGED (1 << 1) /* the folded form differs from s */
+
+/* each *.c file provides one or more policies, the ascii one is always
+ * available while the unicode ones depend on the configured libraries.
  */
+#include "ascii.c"
 #ifdef HAVE_GLIB
 # include "unicode-glib.c"
-#elif defined HAVE_LIBICUUC
+#endif
+#ifdef HAVE_LIBICUUC
 # include "unicode-icu.c"
-#else
-# include "ascii.c"
 #endif
 
+#include "hashmap.c"
+
 #define log_print(format, args...) (*dolog)(format, ## args)
 
 #ifdef NDEBUG
@@ -96,6 +141,8 @@
 #endif
 
 #define CIOPFS_ATTR_NAME "user.filename"
+#define CIOPFS_STATS_ATTR_NAME "user.ciopfs.stats"
+#define CIOPFS_CLEAN_ATTR_NAME "user.ciopfs.clean"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -106,11 +153,41 @@
 #endif
 
 static const char *dirname;
-/* whether we have forced fuse in single threaded mode (`-s' option). This happens
- * because we can't store uid/gids per thread and the file system is accessible for
- * multiple users via the `-o allow_other' option.
+/* whether the file system was mounted by root and is accessible for multiple
+ * users via the `-o allow_other' option. Requests are then served with the
+ * credentials of the calling user, see enter_user_context_effective().
  */
-static bool single_threaded = false;
+static bool multi_user = false;
+/* case folding policy (`-o fold=') and the unicode normalization which is
+ * applied before folding names (`-o nfc'), this makes precomposed and
+ * decomposed variants of a name equivalent.
+ */
+static const struct fold_ops *fold_ops, *nfc_ops;
+static bool normalize_nfc = false;
+/* memory in bytes used to cache folded path components (`-o fold_cache='),
+ * by default it is disabled for the ascii policy where folding is cheaper
+ * than a lookup.
+ */
+#define FOLD_CACHE_AUTO ((size_t)-1)
+static size_t fold_cache_size = FOLD_CACHE_AUTO;
+/* how long in seconds attributes of existing (`-o attr_cache=') and
+ * non existing files (`-o negative_cache=') are cached by ciopfs, this
+ * is independent of the attribute cache of the kernel.
+ */
+static double attr_cache_ttl = 0, negative_cache_ttl = 0;
+/* memory in bytes shared by all caches (`-o cache_mem='), 0 means every
+ * cache has its own budget */
+static size_t cache_mem = 0;
+static struct hashmap_pool *cache_pool;
+/* memory in bytes used to cache directory listings (`-o dir_cache=') */
+static size_t dir_cache_size = 0;
+/* how long in seconds extended attributes are cached (`-o xattr_cache=') */
+static double xattr_cache_ttl = 0;
+/* pretend that security.capability is unsupported (`-o nocaps') which
+ * saves a lookup on every write */
+static bool nocaps = false;
+/* mark directories without any case preserved names (`-o dirflags') */
+static bool dirflags = false;
 
 void stderr_print(const char *fmt, ...)
 {
@@ -131,21 +208,331 @@ void syslog_print(const char *fmt, ...)
 
 static void (*dolog)(const char *fmt, ...) = syslog_print;
 
+/* Scratch memory for the duration of a single file system operation.
+ *
+ * Each worker thread owns an arena from which all temporary allocations
+ * of a request are served by bumping an offset. It is reset once the
+ * request is done. Allocations which don't fit are served by malloc(3)
+ * and released upon reset. The buffer is allocated by the thread itself
+ * when it serves its first request, after it was pinned to its CPUs.
+ */
+
+#define ARENA_SIZE 16384
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	long data[];
+};
+
+struct arena {
+	size_t used;
+	struct arena_chunk *chunks;
+	long *buf;
+};
+
+static __thread struct arena arena;
+/* background threads are never pinned */
+static __thread bool thread_background;
+
+/* Worker affinity (`-o affinity=cpu|node').
+ *
+ * The fuse library starts and stops worker threads as needed. Each one
+ * pins itself on its first request to the next CPU, or the CPUs of the
+ * next NUMA node, in turn out of those the daemon may run on. Memory it
+ * allocates afterwards, like its arena, is thus local to the node under
+ * the kernel's default first touch policy.
+ */
+
+enum { AFFINITY_NONE, AFFINITY_CPU, AFFINITY_NODE };
+
+static int affinity;
+static cpu_set_t affinity_allowed, *affinity_sets;
+static unsigned int affinity_nsets, affinity_next;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void arena_key_init(void)
+{
+	pthread_key_create(&arena_key, free);
+}
+
+/* adds the CPUs of a list like "0-3,8" to set */
+static void cpulist_parse(const char *s, cpu_set_t *set)
+{
+	char *end;
+	long a, b;
+	while (*s) {
+		a = b = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		if (*end == '-')
+			b = strtol(end + 1, &end, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		if (*end != ',')
+			break;
+		s = end + 1;
+	}
+}
+
+static bool affinity_init(void)
+{
+	cpu_set_t *allowed = &affinity_allowed, node;
+	char path[PATH_MAX], list[4096];
+	unsigned int n = 0;
+	int i, fd;
+	ssize_t len;
+
+	if (affinity == AFFINITY_NONE)
+		return true;
+	if (sched_getaffinity(0, sizeof(*allowed), allowed) ||
+	    !(affinity_sets = calloc(CPU_SETSIZE, sizeof(cpu_set_t))))
+		return false;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (affinity == AFFINITY_CPU) {
+			if (!CPU_ISSET(i, allowed))
+				continue;
+			CPU_SET(i, &affinity_sets[n++]);
+			continue;
+		}
+		snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", i);
+		if ((fd = open(path, O_RDONLY)) == -1)
+			continue;
+		len = read(fd, list, sizeof(list) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		list[len] = '\0';
+		CPU_ZERO(&node);
+		cpulist_parse(list, &node);
+		CPU_AND(&affinity_sets[n], &node, allowed);
+		if (CPU_COUNT(&affinity_sets[n]))
+			n++;
+	}
+	affinity_nsets = n;
+	if (n <= 1)
+		log_print("affinity: only %u %s available, not pinning threads\n", n,
+		          affinity == AFFINITY_CPU ? "CPUs" : "nodes");
+	return true;
+}
+
+/* sets up a thread on its first request */
+static void thread_init(void)
+{
+	unsigned int i;
+	if (affinity_nsets > 1 && !thread_background) {
+		i = __atomic_fetch_add(&affinity_next, 1, __ATOMIC_RELAXED) % affinity_nsets;
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity_sets[i]);
+	}
+	/* the buffer is freed once the thread exits */
+	pthread_once(&arena_key_once, arena_key_init);
+	if ((arena.buf = malloc(ARENA_SIZE)))
+		pthread_setspecific(arena_key, arena.buf);
+}
+
+static void *arena_alloc(size_t size)
+{
+	struct arena_chunk *c;
+	size = (size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+	if (unlikely(!arena.buf))
+		thread_init();
+	if (likely(arena.buf && size <= ARENA_SIZE - arena.used)) {
+		void *p = (char *)arena.buf + arena.used;
+		arena.used += size;
+		return p;
+	}
+	if (!(c = malloc(sizeof(*c) + size)))
+		return NULL;
+	c->next = arena.chunks;
+	arena.chunks = c;
+	return c->data;
+}
+
+static void arena_reset(void)
+{
+	struct arena_chunk *c, *next;
+	for (c = arena.chunks; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	arena.chunks = NULL;
+	arena.used = 0;
+}
+
+/* Folds s after normalizing it to NFC if requested, see struct fold_ops. Names
+ * which pass the quick check are folded without an intermediate copy.
+ */
+static size_t fold_name(const char *s, char *dest, size_t size, int *flags)
+{
+	char *tmp;
+	size_t len;
+
+	if (normalize_nfc && !nfc_ops->is_nfc(s)) {
+		if ((len = nfc_ops->nfc(s, NULL, 0)) == (size_t)-1)
+			return len;
+		if (!(tmp = arena_alloc(len + 1)))
+			return (size_t)-1;
+		nfc_ops->nfc(s, tmp, len + 1);
+		len = fold_ops->fold(tmp, dest, size, flags);
+		if (flags && strcmp(s, tmp))
+			*flags |= FOLD_CHANGED;
+		return len;
+	}
+	return fold_ops->fold(s, dest, size, flags);
+}
+
+/* Whether s is a name as stored in the underlying file system */
+static inline bool name_is_folded(const char *s)
+{
+	char *folded;
+	size_t len;
+	if (!fold_ops->is_folded(s))
+		return false;
+	if (!normalize_nfc || nfc_ops->is_nfc(s))
+		return true;
+	/* the quick check was inconclusive, full folding of some characters
+	 * yields names which are not in NFC, those are stored as they are */
+	if ((len = fold_name(s, NULL, 0, NULL)) == (size_t)-1 || len != strlen(s))
+		return false;
+	if (!(folded = arena_alloc(len + 1)))
+		return false;
+	fold_name(s, folded, len + 1, NULL);
+	return !strcmp(folded, s);
+}
+
+/* Looks up a folding policy by name, NULL selects the best one available.
+ * glib provides full folding if both libraries are configured, such builds
+ * used it before and its tables differ from the ones of libicu.
+ */
+static const struct fold_ops *fold_policy(const char *name)
+{
+	static const struct fold_ops *policies[] = {
+#ifdef HAVE_GLIB
+		&glib_fold_ops,
+#endif
+#ifdef HAVE_LIBICUUC
+		&icu_fold_ops,
+		&icu_simple_fold_ops,
+#endif
+		&ascii_fold_ops,
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		if (!name || !strcmp(name, policies[i]->name))
+			return policies[i];
+	}
+	return NULL;
+}
+
+/* Cache of folded path components shared by all threads.
+ *
+ * The same directory prefixes are folded over and over again, with unicode
+ * support this is rather expensive. The cache maps the raw bytes of a
+ * component to its folded form, its memory usage is bounded by
+ * fold_cache_size bytes.
+ */
+
+static struct hashmap *fold_cache;
+
+static bool fold_cache_init(void)
+{
+	if (!fold_cache_size)
+		return true;
+	return (fold_cache = hashmap_new("fold_cache", fold_cache_size));
+}
+
+/* Folds path component wise with the help of the fold cache, the return
+ * value follows the fold_ops conventions. Since folding works on individual
+ * characters and never touches the '/' separator, the result is the same as
+ * fold_name(path, dest, size).
+ */
+static size_t fold_path_cached(const char *path, char *dest, size_t size)
+{
+	char raw[FILENAME_MAX], folded[FILENAME_MAX];
+	const char *s = path, *e;
+	size_t len = 0, n, complen;
+	ssize_t cached;
+
+	for (;;) {
+		for (e = s; *e && *e != '/'; e++);
+		complen = e - s;
+		if (complen >= sizeof(raw))
+			goto uncached;
+		if ((cached = hashmap_get(fold_cache, s, complen, folded, sizeof(folded))) >= 0) {
+			n = cached;
+		} else {
+			memcpy(raw, s, complen);
+			raw[complen] = '\0';
+			n = fold_name(raw, folded, sizeof(folded), NULL);
+			if (n == (size_t)-1)
+				return n;
+			if (n >= sizeof(folded))
+				goto uncached;
+			hashmap_put(fold_cache, s, complen, folded, n);
+		}
+		if (len + n < size)
+			memcpy(dest + len, folded, n);
+		len += n;
+		if (!*e)
+			break;
+		if (len + 1 < size)
+			dest[len] = '/';
+		len++;
+		s = e + 1;
+	}
+
+	if (len < size)
+		dest[len] = '\0';
+	return len;
+uncached:
+	/* fold the remaining part of the path in one go */
+	if (len < size)
+		n = fold_name(s, dest + len, size - len, NULL);
+	else
+		n = fold_name(s, NULL, 0, NULL);
+	return n == (size_t)-1 ? n : len + n;
+}
+
 static char *map_path(const char *path)
 {
 	char *p;
-	/* XXX: memory fragmentation? */
+	size_t len, size;
 	if (path[0] == '/') {
 		if (path[1] == '\0')
-			return strdup(".");
-		path++;
+			path = ".";
+		else
+			path++;
 	}
 
-	p = str_fold(path);
+	size = strlen(path) + 1;
+	if (!(p = arena_alloc(size)))
+		return NULL;
+	len = fold_cache ? fold_path_cached(path, p, size) : fold_name(path, p, size, NULL);
+	if (unlikely(len >= size && len != (size_t)-1)) {
+		/* the folded form is longer than the original one */
+		size = len + 1;
+		if (!(p = arena_alloc(size)))
+			return NULL;
+		len = fold_cache ? fold_path_cached(path, p, size) : fold_name(path, p, size, NULL);
+	}
+	if (len == (size_t)-1)
+		return NULL;
 	debug("%s => %s\n", path, p);
 	return p;
 }
 
+/* Joins the folded directory path dir and the entry name into buf the
+ * same way map_path() names the entry, which is what the caches, the
+ * name log and the directory locks are keyed by.
+ */
+static int child_path(char *buf, size_t size, const char *dir, const char *name)
+{
+	if (!strcmp(dir, "."))
+		return snprintf(buf, size, "%s", name);
+	return snprintf(buf, size, "%s/%s", dir, name);
+}
+
 /* Returns the supplementary group IDs of a calling process which
  * isued the file system operation.
  *
@@ -209,7 +596,7 @@ static size_t get_groups(pid_t pid, gid_t **groups)
 	if (n == 0)
 		return 0;
 
-	*groups = gids = malloc(n * sizeof(gid_t));
+	*groups = gids = arena_alloc(n * sizeof(gid_t));
 	if (!gids)
 		return 0;
 	n = 0;
@@ -226,37 +613,81 @@ static size_t get_groups(pid_t pid, gid_t **groups)
 	return n;
 }
 
-/* This only works when the filesystem is mounted by root and fuse
- * operates in single threaded mode. Because the euid/egid are stored
- * per process this would otherwise cause all sorts of race condidtions
- * and security issues when multiple users access the file system
- * simultaneously.
+/* The C library applies changes of credentials to all threads of the
+ * process, which would cause all sorts of race conditions and security
+ * issues when multiple users access the file system simultaneously. On
+ * Linux credentials are a property of the thread though, the system calls
+ * are therefore made directly and every worker thread switches on its own.
+ * Elsewhere fuse is forced into single threaded mode (`-s' option).
  */
 
+#if defined(__linux__) && defined(SYS_setresuid)
+# define PER_THREAD_CREDENTIALS
+/* 32 bit platforms have separate system calls for 32 bit ids */
+# ifdef SYS_setresuid32
+#  define SYS_cred_setresuid SYS_setresuid32
+#  define SYS_cred_setresgid SYS_setresgid32
+#  define SYS_cred_setgroups SYS_setgroups32
+# else
+#  define SYS_cred_setresuid SYS_setresuid
+#  define SYS_cred_setresgid SYS_setresgid
+#  define SYS_cred_setgroups SYS_setgroups
+# endif
+
+static inline void cred_set_groups(size_t n, const gid_t *groups)
+{
+	syscall(SYS_cred_setgroups, n, groups);
+}
+
+static inline void cred_set_uid(uid_t ruid, uid_t euid)
+{
+	syscall(SYS_cred_setresuid, ruid, euid, -1);
+}
+
+static inline void cred_set_gid(gid_t rgid, gid_t egid)
+{
+	syscall(SYS_cred_setresgid, rgid, egid, -1);
+}
+#else
+static inline void cred_set_groups(size_t n, const gid_t *groups)
+{
+	setgroups(n, groups);
+}
+
+static inline void cred_set_uid(uid_t ruid, uid_t euid)
+{
+	setreuid(ruid, euid);
+}
+
+static inline void cred_set_gid(gid_t rgid, gid_t egid)
+{
+	setregid(rgid, egid);
+}
+#endif
+
 static inline void enter_user_context_effective()
 {
-	gid_t *groups;
+	gid_t *groups = NULL;
 	size_t ngroups;
 	struct fuse_context *c = fuse_get_context();
 
-	if (!single_threaded || getuid())
+	if (!multi_user || getuid())
 		return;
-	if ((ngroups = get_groups(c->pid, &groups))) {
-		setgroups(ngroups, groups);
-		free(groups);
-	}
+	/* always replace the groups, a thread serves requests of all users */
+	ngroups = get_groups(c->pid, &groups);
+	cred_set_groups(ngroups, groups);
 
-	setegid(c->gid);
-	seteuid(c->uid);
+	cred_set_gid(-1, c->gid);
+	cred_set_uid(-1, c->uid);
 }
 
 static inline void leave_user_context_effective()
 {
-	if (!single_threaded || getuid())
+	if (!multi_user || getuid())
 		return;
 
-	seteuid(getuid());
-	setegid(getgid());
+	cred_set_uid(-1, getuid());
+	cred_set_gid(-1, getgid());
 }
 
 /* access(2) checks the real uid/gid not the effective one
@@ -272,116 +703,1476 @@ static inline void leave_user_context_effective()
 
 static inline void enter_user_context_real()
 {
-	gid_t *groups;
+	gid_t *groups = NULL;
 	size_t ngroups;
 	struct fuse_context *c = fuse_get_context();
 
-	if (!single_threaded || geteuid())
+	if (!multi_user || geteuid())
 		return;
-	if ((ngroups = get_groups(c->pid, &groups))) {
-		setgroups(ngroups, groups);
-		free(groups);
-	}
-	setregid(c->gid, -1);
-	setreuid(c->uid, -1);
+	ngroups = get_groups(c->pid, &groups);
+	cred_set_groups(ngroups, groups);
+	cred_set_gid(c->gid, -1);
+	cred_set_uid(c->uid, -1);
 }
 
 static inline void leave_user_context_real()
 {
-	if (!single_threaded || geteuid())
+	if (!multi_user || geteuid())
 		return;
 
-	setuid(geteuid());
-	setgid(getegid());
+	cred_set_uid(geteuid(), -1);
+	cred_set_gid(getegid(), -1);
+}
+
+/* Operations which add, replace or remove names of a directory are
+ * serialized by a lock which is chosen by hashing the folded path of
+ * the directory. This makes sure that the creation of an entry and the
+ * storing of its original name happen atomically with respect to other
+ * operations on case variants of the same name. Distinct directories
+ * only contend if they happen to share a lock stripe.
+ */
+
+#define DIR_LOCKS 256
+
+static pthread_mutex_t dir_locks[DIR_LOCKS];
+
+static void dir_locks_init(void)
+{
+	int i;
+	for (i = 0; i < DIR_LOCKS; i++)
+		pthread_mutex_init(&dir_locks[i], NULL);
 }
 
-static ssize_t ciopfs_get_orig_name(const char *path, char *value, size_t size)
+/* returns the lock stripe of the directory containing the folded path */
+static inline unsigned int dir_lock_index(const char *path)
 {
-	ssize_t attrlen;
-	debug("looking up original file name of %s ", path);
-	attrlen = lgetxattr(path, CIOPFS_ATTR_NAME, value, size);
-	if (attrlen > 0) {
-		value[attrlen] = '\0';
-		debug("found %s\n", value);
-	} else {
-		debug("nothing found\n");
-	}
-	return attrlen;
+	const char *s = strrchr(path, '/');
+	return hash_bytes(path, s ? s - path : 0) % DIR_LOCKS;
 }
 
-static int ciopfs_set_orig_name_fd(int fd, const char *origpath)
+/* returns the lock stripe of the entries of the folded directory path */
+static inline unsigned int dir_lock_index_dir(const char *path)
 {
-	char *filename = strrchr(origpath, '/');
-	if (!filename)
-		filename = (char *)origpath;
-	else
-		filename++;
-#ifndef NDEBUG
-	char *path = map_path(origpath);
-	if (likely(path != NULL)) {
-		log_print("storing original name '%s' in '%s'\n", filename, path);
-		free(path);
-	}
-#endif
-	if (fsetxattr(fd, CIOPFS_ATTR_NAME, filename, strlen(filename), 0)) {
-		int ret = -errno;
-		debug("%s\n", strerror(errno));
-		return ret;
+	return hash_bytes(path, strcmp(path, ".") ? strlen(path) : 0) % DIR_LOCKS;
+}
+
+static void dir_lock(const char *path)
+{
+	pthread_mutex_lock(&dir_locks[dir_lock_index(path)]);
+}
+
+static void dir_unlock(const char *path)
+{
+	pthread_mutex_unlock(&dir_locks[dir_lock_index(path)]);
+}
+
+/* locks the directories of both paths, always in the same order to
+ * prevent dead locks between concurrent renames */
+static void dir_lock2(const char *path1, const char *path2)
+{
+	unsigned int i = dir_lock_index(path1), j = dir_lock_index(path2);
+	pthread_mutex_lock(&dir_locks[i < j ? i : j]);
+	if (i != j)
+		pthread_mutex_lock(&dir_locks[i < j ? j : i]);
+}
+
+static void dir_unlock2(const char *path1, const char *path2)
+{
+	unsigned int i = dir_lock_index(path1), j = dir_lock_index(path2);
+	pthread_mutex_unlock(&dir_locks[i]);
+	if (i != j)
+		pthread_mutex_unlock(&dir_locks[j]);
+}
+
+/* Opens the file p with the given flags which include O_CREAT. Unless the
+ * caller insists on O_EXCL an existing case variant of the file is opened
+ * instead, *created tells whether a new file was created whose original
+ * name has to be stored. Must be called with the directory lock held.
+ */
+static int open_create(const char *p, int flags, mode_t mode, bool *created)
+{
+	int fd;
+	*created = true;
+	if ((fd = open(p, flags | O_EXCL, mode)) != -1 || errno != EEXIST ||
+	    (flags & O_EXCL))
+		return fd;
+	*created = false;
+	return open(p, flags, mode);
+}
+
+/* Daemon side cache of file attributes keyed by folded path.
+ *
+ * This saves round trips if the underlying file system is slow to stat,
+ * like NFS or CIFS. Entries expire after the configured time and are
+ * invalidated by every operation which modifies them. Because the
+ * attributes of a file are shared by all its hard links, regular files
+ * with multiple links are never cached. The cache is disabled in multi
+ * user mode because a lookup would bypass the permission checks of the
+ * individual users.
+ *
+ * Every invalidation bumps a generation counter, an entry is only
+ * inserted if no invalidation happened since the attributes were read.
+ * This prevents stale attributes from a racing lookup to be cached.
+ */
+
+struct attr_cache_entry {
+	struct timespec expires;
+	int err;
+	struct stat st;
+};
+
+static struct hashmap *attr_cache, *xattr_cache, *dir_cache;
+static unsigned long cache_generation;
+
+/* attributes looked up with the credentials of one user must not be
+ * served to another one */
+static bool attr_cache_init(void)
+{
+	if (multi_user)
+		return true;
+	if ((attr_cache_ttl || negative_cache_ttl) &&
+	    !(attr_cache = hashmap_new("attr_cache", 4 * 1024 * 1024)))
+		return false;
+	if (xattr_cache_ttl &&
+	    !(xattr_cache = hashmap_new("xattr_cache", 4 * 1024 * 1024)))
+		return false;
+	return true;
+}
+
+static inline unsigned long cache_gen(void)
+{
+	return __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE);
+}
+
+static inline bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* sets ts to the point in time ttl seconds from now */
+static void cache_expiry(double ttl, struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += (time_t)ttl;
+	ts->tv_nsec += (ttl - (time_t)ttl) * 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
 	}
-	return 0;
 }
 
-static int ciopfs_set_orig_name_path(const char *path, const char *origpath)
+static bool cache_expired(const struct timespec *ts)
 {
-	char *filename = strrchr(origpath, '/');
-	if (!filename)
-		filename = (char *)origpath;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_before(ts, &now);
+}
+
+/* Looks up the attributes of the folded path p, returns false if they
+ * aren't cached. Otherwise *err is either 0 and st is filled in or it
+ * is the negated errno value of a failed lookup.
+ */
+static bool attr_cache_get(const char *p, struct stat *st, int *err)
+{
+	struct attr_cache_entry e;
+
+	if (!attr_cache || hashmap_get(attr_cache, p, strlen(p), &e, sizeof(e)) != sizeof(e))
+		return false;
+	if (cache_expired(&e.expires))
+		return false;
+	if (!(*err = e.err))
+		*st = e.st;
+	return true;
+}
+
+/* caches the outcome of a lookup which started at generation gen */
+static void attr_cache_put(const char *p, const struct stat *st, int err,
+                           unsigned long gen)
+{
+	struct attr_cache_entry e;
+	double ttl = err ? negative_cache_ttl : attr_cache_ttl;
+
+	if (!attr_cache || !ttl || (err && err != -ENOENT))
+		return;
+	if (!err && !S_ISDIR(st->st_mode) && st->st_nlink > 1)
+		return;
+	cache_expiry(ttl, &e.expires);
+	e.err = err;
+	if (!err)
+		e.st = *st;
 	else
-		filename++;
-	debug("storing original name '%s' in '%s'\n", filename, path);
-	/* XXX: setting an extended attribute on a symlink doesn't seem to work (EPERM) */
-	if (lsetxattr(path, CIOPFS_ATTR_NAME, filename, strlen(filename), 0)) {
-		int ret = -errno;
-		debug("%s\n", strerror(errno));
-		return ret;
-	}
-	return 0;
+		memset(&e.st, 0, sizeof(e.st));
+	if (gen == cache_gen())
+		hashmap_put(attr_cache, p, strlen(p), &e, sizeof(e));
+	if (gen != cache_gen())
+		hashmap_del(attr_cache, p, strlen(p));
 }
 
-static int ciopfs_remove_orig_name(const char *path)
+/* Extended attributes are cached per folded path. All attributes of a
+ * path which were looked up so far are stored in one entry as a list of
+ * records, this way they can be invalidated together. Records of non
+ * existing attributes (ENODATA) are kept as well, they are by far the
+ * most common: the kernel asks for security.capability on every write.
+ * As with attributes, files with multiple hard links are not cached since
+ * a change through one of their paths would leave the others stale.
+ */
+
+struct xattr_cache_entry {
+	struct timespec expires;
+	char records[];
+};
+
+struct xattr_cache_record {
+	uint16_t namelen;
+	uint16_t flags;
+	int32_t len;      /* length of the value or negated errno value */
+	char data[];      /* name followed by the value */
+};
+
+#define XATTR_CACHE_ENTRY_MAX 4096
+/* the value is an original name which was found to match the path */
+#define XATTR_CACHE_VALID (1 << 0)
+
+static struct xattr_cache_record *xattr_cache_find(char *buf, size_t len, const char *name)
 {
-	debug("removing original file name of %s\n", path);
-	return lremovexattr(path, CIOPFS_ATTR_NAME);
+	struct xattr_cache_record *r;
+	size_t namelen = strlen(name);
+	size_t off = offsetof(struct xattr_cache_entry, records);
+
+	while (off + sizeof(*r) <= len) {
+		r = (struct xattr_cache_record *)(buf + off);
+		if (r->namelen == namelen && !memcmp(r->data, name, namelen))
+			return r;
+		off += sizeof(*r) + r->namelen + (r->len > 0 ? r->len : 0);
+		off = (off + 3) & ~(size_t)3;
+	}
+	return NULL;
 }
 
-static int ciopfs_getattr(const char *path, struct stat *st_data)
+/* Looks up the extended attribute name of the folded path p with the
+ * semantics of getxattr(2), returns false if it isn't cached. The flags
+ * of the record are stored in flags unless it is NULL.
+ */
+static bool xattr_cache_get(const char *p, const char *name, char *value,
+                            size_t size, ssize_t *res, int *flags)
 {
-	char *p = map_path(path);
-	if (unlikely(p == NULL))
-		return -ENOMEM;
-	enter_user_context_effective();
-	int res = lstat(p, st_data);
-	if (res == -1)
-		res = -errno;
-	leave_user_context_effective();
-	free(p);
-	return res;
+	char buf[XATTR_CACHE_ENTRY_MAX];
+	struct xattr_cache_record *r;
+	ssize_t len;
+
+	if (!xattr_cache)
+		return false;
+	len = hashmap_get(xattr_cache, p, strlen(p), buf, sizeof buf);
+	if (len < (ssize_t)sizeof(struct xattr_cache_entry) || len > sizeof buf ||
+	    cache_expired(&((struct xattr_cache_entry *)buf)->expires))
+		return false;
+	if (!(r = xattr_cache_find(buf, len, name)))
+		return false;
+	if (flags)
+		*flags = r->flags;
+	if (r->len < 0 || size == 0)
+		*res = r->len;
+	else if (r->len > size)
+		*res = -ERANGE;
+	else
+		memcpy(value, r->data + r->namelen, *res = r->len);
+	return true;
 }
 
-static int ciopfs_fgetattr(const char *path, struct stat *stbuf,
-                           struct fuse_file_info *fi)
+/* adds the outcome of a lookup which started at generation gen to the cache */
+static void xattr_cache_put(const char *p, const char *name, const char *value,
+                            ssize_t len, unsigned long gen)
 {
-	enter_user_context_effective();
-	int res = fstat(fi->fh, stbuf);
-	if (res == -1)
-		res = -errno;
-	leave_user_context_effective();
-	return res;
+	char buf[XATTR_CACHE_ENTRY_MAX];
+	struct xattr_cache_entry *e = (struct xattr_cache_entry *)buf;
+	struct xattr_cache_record *r;
+	size_t namelen = strlen(name);
+	struct stat st;
+	ssize_t off;
+
+	if (!xattr_cache || (len < 0 && len != -ENODATA))
+		return;
+	if (lstat(p, &st) == -1 || (!S_ISDIR(st.st_mode) && st.st_nlink > 1))
+		return;
+	off = hashmap_get(xattr_cache, p, strlen(p), buf, sizeof buf);
+	if (off < (ssize_t)sizeof(*e) || off > sizeof buf || cache_expired(&e->expires)) {
+		cache_expiry(xattr_cache_ttl, &e->expires);
+		off = sizeof(*e);
+	} else if (xattr_cache_find(buf, off, name)) {
+		return;
+	}
+	off = (off + 3) & ~(size_t)3;
+	if (off + sizeof(*r) + namelen + (len > 0 ? len : 0) > sizeof buf)
+		return;
+	r = (struct xattr_cache_record *)(buf + off);
+	r->namelen = namelen;
+	r->flags = 0;
+	r->len = len;
+	memcpy(r->data, name, namelen);
+	if (len > 0)
+		memcpy(r->data + namelen, value, len);
+	off += sizeof(*r) + namelen + (len > 0 ? len : 0);
+	if (gen == cache_gen())
+		hashmap_put(xattr_cache, p, strlen(p), buf, off);
+	if (gen != cache_gen())
+		hashmap_del(xattr_cache, p, strlen(p));
 }
 
-static int ciopfs_readlink(const char *path, char *buf, size_t size)
+/* Marks the cached original name of p as valid if it is still orig. The
+ * original name is shared by all hard links of a file and rewritten by
+ * every link(2), thus it is never considered valid for those.
+ */
+static void xattr_cache_set_valid(const char *p, const char *orig, unsigned long gen)
 {
-	int ret;
+	char buf[XATTR_CACHE_ENTRY_MAX];
+	struct xattr_cache_record *r;
+	size_t len = strlen(orig);
+	struct stat st;
+	ssize_t off;
+
+	if (!xattr_cache)
+		return;
+	if (lstat(p, &st) == -1 || (!S_ISDIR(st.st_mode) && st.st_nlink > 1))
+		return;
+	off = hashmap_get(xattr_cache, p, strlen(p), buf, sizeof buf);
+	if (off < (ssize_t)sizeof(struct xattr_cache_entry) || off > sizeof buf ||
+	    !(r = xattr_cache_find(buf, off, CIOPFS_ATTR_NAME)) ||
+	    r->len != len || memcmp(r->data + r->namelen, orig, len))
+		return;
+	r->flags |= XATTR_CACHE_VALID;
+	if (gen == cache_gen())
+		hashmap_put(xattr_cache, p, strlen(p), buf, off);
+	if (gen != cache_gen())
+		hashmap_del(xattr_cache, p, strlen(p));
+}
+
+/* Snapshot of original names (`-o snapshot=FILE').
+ *
+ * After a remount the first listing of every directory has to look up
+ * the original name of each entry again. Complete listings are kept in
+ * memory just like for the directory cache and written to a snapshot
+ * file at unmount, together with the blocks of the previous snapshot
+ * which are still valid. The snapshot is mapped into memory at the next
+ * mount. Saving it only checks the modification time of every directory
+ * and doesn't read any of them again. A
+ * directory from the snapshot is only used if its inode number and
+ * modification time are unchanged; every operation which changes a name
+ * also changes the mtime of the directory. Afterwards the directory is
+ * dropped from the snapshot by the same invalidation which applies to
+ * the caches.
+ *
+ * Attributes are not part of the snapshot because changes to the content
+ * of a file are not reflected in the mtime of its directory.
+ *
+ * The file consists of a header followed by one block per directory:
+ *
+ *   struct snapshot_dir
+ *   struct snapshot_entry[nentries]   sorted by folded name
+ *   directory path, folded names and original names, NUL terminated
+ */
+
+#define SNAPSHOT_MAGIC "ciopfs1"
+
+struct snapshot_header {
+	char magic[8];
+	char policy[16];  /* folding policy the names were folded with */
+	uint32_t nfc;
+	uint32_t ndirs;
+};
+
+struct snapshot_dir {
+	uint64_t ino;
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t size;     /* of the whole block, a multiple of 8 */
+	uint32_t nentries;
+};
+
+struct snapshot_entry {
+	uint32_t name;     /* offset of the folded name within the block */
+	uint32_t orig;     /* offset of the original name or 0 if there is none */
+};
+
+static char *snapshot_file;
+static void *snapshot_map;
+static size_t snapshot_size;
+/* maps directory paths to their valid blocks in the snapshot */
+static struct hashmap *snapshot_index;
+/* listings of the directories which were completely read since the mount,
+ * they are saved unless the directory changed */
+static struct hashmap *snapshot_dirs;
+#define SNAPSHOT_DIRS_BUDGET (16 * 1024 * 1024)
+
+/* Looks up the original name of the folded path p with the semantics of
+ * lgetxattr(2), returns false if the snapshot doesn't know about it.
+ */
+static bool snapshot_get(const char *p, char *value, size_t size, ssize_t *res)
+{
+	const struct snapshot_dir *d;
+	const struct snapshot_entry *e;
+	const char *name = strrchr(p, '/'), *dir = name ? p : ".";
+	size_t lo = 0, hi, dirlen = name ? name - p : 1;
+	int cmp;
+
+	if (!snapshot_index ||
+	    hashmap_get(snapshot_index, dir, dirlen, &d, sizeof(d)) != sizeof(d))
+		return false;
+	name = name ? name + 1 : p;
+	e = (const struct snapshot_entry *)(d + 1);
+	hi = d->nentries;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (!(cmp = strcmp(name, (const char *)d + e[mid].name))) {
+			const char *orig = (const char *)d + e[mid].orig;
+			size_t len = strlen(orig);
+			if (!e[mid].orig)
+				*res = -ENODATA;
+			else if (size == 0)
+				*res = len;
+			else if (len > size)
+				*res = -ERANGE;
+			else
+				memcpy(value, orig, *res = len);
+			return true;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return false;
+}
+
+/* maps the snapshot and indexes all directories which are still valid */
+static void snapshot_load(void)
+{
+	const struct snapshot_header *h;
+	const struct snapshot_dir *d;
+	const struct snapshot_entry *e;
+	struct stat st;
+	size_t off, i, valid = 0;
+	uint32_t n;
+	int fd;
+
+	if (!(snapshot_index = hashmap_new("snapshot", 0)) ||
+	    !(snapshot_dirs = hashmap_new("snapshot_dirs", SNAPSHOT_DIRS_BUDGET)))
+		return;
+	if ((fd = open(snapshot_file, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &st) || st.st_size < sizeof(*h) ||
+	    (snapshot_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		snapshot_map = NULL;
+		close(fd);
+		return;
+	}
+	close(fd);
+	snapshot_size = st.st_size;
+	h = snapshot_map;
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+	    strncmp(h->policy, fold_ops->name, sizeof(h->policy)) || h->nfc != normalize_nfc) {
+		log_print("snapshot: ignoring %s, it was created with different options\n",
+		          snapshot_file);
+		return;
+	}
+	for (off = sizeof(*h), n = 0; n < h->ndirs; n++, off += d->size) {
+		d = (const struct snapshot_dir *)((char *)snapshot_map + off);
+		if (snapshot_size - off < sizeof(*d) || d->size > snapshot_size - off ||
+		    d->size < sizeof(*d) + d->nentries * sizeof(*e) + 1 || d->size % 8 ||
+		    ((char *)d)[d->size - 1])
+			break;
+		/* all strings are NUL terminated because the block is */
+		e = (const struct snapshot_entry *)(d + 1);
+		for (i = 0; i < d->nentries; i++) {
+			if (e[i].name >= d->size || e[i].orig >= d->size)
+				break;
+		}
+		if (i < d->nentries)
+			break;
+		const char *path = (const char *)(e + d->nentries);
+		if (lstat(path, &st) || st.st_ino != d->ino ||
+		    st.st_mtim.tv_sec != d->mtime_sec || st.st_mtim.tv_nsec != d->mtime_nsec)
+			continue;
+		hashmap_put(snapshot_index, path, strlen(path), &d, sizeof(d));
+		valid++;
+	}
+	if (n < h->ndirs)
+		log_print("snapshot: %s is corrupt\n", snapshot_file);
+	log_print("snapshot: %zu of %u directories are valid\n", valid, h->ndirs);
+}
+
+/* Invalidates everything cached about the folded path p and the attributes
+ * of its parent directory whose timestamps and link count change along
+ * with it.
+ */
+static void cache_invalidate(const char *p)
+{
+	const char *s = strrchr(p, '/'), *parent = s ? p : ".";
+	size_t parentlen = s ? s - p : 1;
+	if (!attr_cache && !xattr_cache && !snapshot_index && !dir_cache)
+		return;
+	__atomic_fetch_add(&cache_generation, 1, __ATOMIC_RELEASE);
+	if (xattr_cache)
+		hashmap_del(xattr_cache, p, strlen(p));
+	if (dir_cache) {
+		hashmap_del(dir_cache, p, strlen(p));
+		hashmap_del(dir_cache, parent, parentlen);
+	}
+	if (snapshot_index) {
+		hashmap_del(snapshot_index, p, strlen(p));
+		hashmap_del(snapshot_index, parent, parentlen);
+		hashmap_del(snapshot_dirs, p, strlen(p));
+		hashmap_del(snapshot_dirs, parent, parentlen);
+	}
+	if (attr_cache) {
+		hashmap_del(attr_cache, p, strlen(p));
+		hashmap_del(attr_cache, parent, parentlen);
+	}
+}
+
+/* invalidates all cached data, needed if a whole subtree changes */
+static void cache_invalidate_all(void)
+{
+	if (!attr_cache && !xattr_cache && !snapshot_index && !dir_cache)
+		return;
+	__atomic_fetch_add(&cache_generation, 1, __ATOMIC_RELEASE);
+	if (attr_cache)
+		hashmap_clear(attr_cache);
+	if (dir_cache)
+		hashmap_clear(dir_cache);
+	if (xattr_cache)
+		hashmap_clear(xattr_cache);
+	if (snapshot_index) {
+		hashmap_clear(snapshot_index);
+		hashmap_clear(snapshot_dirs);
+	}
+}
+
+/* Invalidates the cached attributes of an open file which is only known
+ * by its unmapped path after its size or timestamps changed, this is a
+ * no-op if the attribute cache is disabled.
+ */
+static void cache_invalidate_attr(const char *path)
+{
+	char *p;
+	if (!attr_cache)
+		return;
+	__atomic_fetch_add(&cache_generation, 1, __ATOMIC_RELEASE);
+	if ((p = map_path(path)))
+		hashmap_del(attr_cache, p, strlen(p));
+	else
+		hashmap_clear(attr_cache);
+}
+
+/* Write ahead log of original names (`-o namelog=FILE').
+ *
+ * Storing the original name as an extended attribute is a separate
+ * metadata update for every created file, a storm of creates is thus
+ * bound by the journal of the underlying file system. In namelog mode
+ * original names are instead appended to a log which is written by a
+ * committer thread: all records which accumulated while the previous
+ * batch was written are written and synced together (group commit).
+ * Like an extended attribute a name is durable once the batch which
+ * contains it is committed.
+ *
+ * Until a background thread has materialized them as extended attributes
+ * the names are kept in a pending map which is consulted before the
+ * attributes. Three kinds of records exist:
+ *
+ *   SET    path name    path was created with the original name
+ *   DEL    path         path was removed before its name was materialized
+ *   RENAME from to      the directory from was renamed to
+ *
+ * The log is replayed at mount time and compacted once it grows beyond
+ * NAMELOG_COMPACT bytes and all names are materialized.
+ */
+
+enum {
+	NAMELOG_SET = 'S',
+	NAMELOG_DEL = 'D',
+	NAMELOG_RENAME = 'R',
+};
+
+#define NAMELOG_COMPACT (4 * 1024 * 1024)
+/* time in milliseconds to wait for more records before a batch is written
+ * or materialized, creators never wait for a commit so this only bounds
+ * the window in which names can be lost by a crash */
+#define NAMELOG_COMMIT_DELAY 10
+#define NAMELOG_MATERIALIZE_DELAY 100
+
+static void namelog_sleep(int ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+struct namelog_header {
+	uint32_t len;  /* of the record following the header */
+	uint32_t hash; /* of the record, detects torn writes */
+};
+
+/* a name which still has to be materialized */
+struct namelog_entry {
+	struct namelog_entry *next;
+	char *name;    /* points into path */
+	char path[];
+};
+
+static char *namelog_file;
+static int namelog_fd = -1, namelog_dirfd = -1;
+/* directory containing the log, synced after the log was replaced */
+static int namelog_parentfd = -1;
+static struct hashmap *namelog_pending;
+static pthread_mutex_t namelog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t namelog_commit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t namelog_work_cond = PTHREAD_COND_INITIALIZER;
+/* held for writing while a directory rename rewrites queued paths */
+static pthread_rwlock_t namelog_rename_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char *namelog_buf;
+static size_t namelog_buflen, namelog_bufsize, namelog_size;
+static struct namelog_entry *namelog_queue, **namelog_tail = &namelog_queue;
+/* entries taken from the queue which the materializer works through */
+static struct namelog_entry *namelog_batch;
+static bool namelog_busy, namelog_stop;
+static pthread_t namelog_committer, namelog_materializer;
+
+/* must be called with namelog_mutex held */
+static void namelog_append(char type, const char *a, const char *b)
+{
+	size_t alen = strlen(a) + 1, blen = b ? strlen(b) + 1 : 0;
+	size_t len = sizeof(struct namelog_header) + 1 + alen + blen;
+	struct namelog_header h;
+	char *rec;
+
+	if (namelog_fd == -1)
+		return;
+	if (namelog_buflen + len > namelog_bufsize) {
+		size_t size = namelog_bufsize ? namelog_bufsize : 65536;
+		while (namelog_buflen + len > size)
+			size *= 2;
+		if (!(rec = realloc(namelog_buf, size))) {
+			log_print("namelog: %s\n", strerror(ENOMEM));
+			return;
+		}
+		namelog_buf = rec;
+		namelog_bufsize = size;
+	}
+	rec = namelog_buf + namelog_buflen + sizeof(h);
+	rec[0] = type;
+	memcpy(rec + 1, a, alen);
+	if (b)
+		memcpy(rec + 1 + alen, b, blen);
+	h.len = 1 + alen + blen;
+	h.hash = hash_bytes(rec, h.len);
+	memcpy(namelog_buf + namelog_buflen, &h, sizeof(h));
+	namelog_buflen += len;
+	pthread_cond_signal(&namelog_commit_cond);
+}
+
+/* must be called with namelog_mutex held */
+static bool namelog_enqueue(const char *path, const char *name)
+{
+	size_t len = strlen(path) + 1;
+	struct namelog_entry *e = malloc(sizeof(*e) + len + strlen(name) + 1);
+	if (!e)
+		return false;
+	memcpy(e->path, path, len);
+	e->name = strcpy(e->path + len, name);
+	e->next = NULL;
+	*namelog_tail = e;
+	namelog_tail = &e->next;
+	hashmap_put(namelog_pending, path, len - 1, name, strlen(name) + 1);
+	pthread_cond_signal(&namelog_work_cond);
+	return true;
+}
+
+/* Records name as the original name of the folded path p, must be called
+ * with the directory lock of p held.
+ */
+static int namelog_set(const char *p, const char *name)
+{
+	int ret = 0;
+	pthread_mutex_lock(&namelog_mutex);
+	if (namelog_enqueue(p, name))
+		namelog_append(NAMELOG_SET, p, name);
+	else
+		ret = -ENOMEM;
+	pthread_mutex_unlock(&namelog_mutex);
+	return ret;
+}
+
+/* forgets a not yet materialized name of the folded path p */
+static void namelog_forget(const char *p)
+{
+	if (!namelog_pending || hashmap_get(namelog_pending, p, strlen(p), NULL, 0) == -1)
+		return;
+	pthread_mutex_lock(&namelog_mutex);
+	hashmap_del(namelog_pending, p, strlen(p));
+	namelog_append(NAMELOG_DEL, p, NULL);
+	pthread_mutex_unlock(&namelog_mutex);
+}
+
+/* must be called with namelog_mutex and namelog_rename_lock held */
+static void namelog_rewrite_list(struct namelog_entry **list, struct namelog_entry ***tail,
+                                 const char *from, const char *to)
+{
+	struct namelog_entry *e, *n, **prev;
+	size_t flen = strlen(from), tlen = strlen(to);
+	char name[FILENAME_MAX];
+
+	for (prev = list; (e = *prev); prev = &(*prev)->next) {
+		if (strncmp(e->path, from, flen) || e->path[flen] != '/')
+			continue;
+		size_t len = strlen(e->path) - flen + tlen + 1;
+		if (!(n = malloc(sizeof(*n) + len + strlen(e->name) + 1)))
+			continue;
+		memcpy(n->path, to, tlen);
+		strcpy(n->path + tlen, e->path + flen);
+		n->name = strcpy(n->path + len, e->name);
+		n->next = e->next;
+		if (tail && *tail == &e->next)
+			*tail = &n->next;
+		*prev = n;
+		ssize_t nlen = hashmap_get(namelog_pending, e->path, strlen(e->path), name, sizeof name);
+		if (nlen > 0 && nlen <= sizeof name && !strcmp(name, e->name)) {
+			hashmap_del(namelog_pending, e->path, strlen(e->path));
+			hashmap_put(namelog_pending, n->path, len - 1, n->name, strlen(n->name) + 1);
+		}
+		free(e);
+	}
+}
+
+/* rewrites the paths of all pending names below the directory from */
+static void namelog_rewrite(const char *from, const char *to)
+{
+	namelog_rewrite_list(&namelog_queue, &namelog_tail, from, to);
+	namelog_rewrite_list(&namelog_batch, NULL, from, to);
+}
+
+/* Keeps the materializer from writing names below a directory while it is
+ * renamed, the backing rename has to happen under this lock or a batch
+ * taken before it would write to the old paths and lose the names.
+ */
+static void namelog_rename_begin(void)
+{
+	if (namelog_pending)
+		pthread_rwlock_wrlock(&namelog_rename_lock);
+}
+
+static void namelog_rename_end(void)
+{
+	if (namelog_pending)
+		pthread_rwlock_unlock(&namelog_rename_lock);
+}
+
+/* Moves the pending names below the renamed directory from to to, must be
+ * called between namelog_rename_begin and namelog_rename_end.
+ */
+static void namelog_rename(const char *from, const char *to)
+{
+	if (!namelog_pending)
+		return;
+	pthread_mutex_lock(&namelog_mutex);
+	namelog_rewrite(from, to);
+	namelog_append(NAMELOG_RENAME, from, to);
+	pthread_mutex_unlock(&namelog_mutex);
+}
+
+/* looks up a not yet materialized name of the folded path p */
+static ssize_t namelog_get(const char *p, char *value, size_t size)
+{
+	ssize_t len;
+	if (!namelog_pending)
+		return -1;
+	len = hashmap_get(namelog_pending, p, strlen(p), value, size);
+	if (len > size) {
+		errno = ERANGE;
+		return -1;
+	}
+	return len > 0 ? len - 1 : len;
+}
+
+/* writes all queued records to a fresh log and atomically replaces the
+ * current one with it, must be called with namelog_mutex held */
+static void namelog_compact(void)
+{
+	struct namelog_entry *e;
+	char tmp[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, sizeof tmp, "%s.tmp", namelog_file);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		namelog_size = 0;
+		return;
+	}
+	namelog_buflen = 0;
+	for (e = namelog_queue; e; e = e->next)
+		namelog_append(NAMELOG_SET, e->path, e->name);
+	if (write(fd, namelog_buf, namelog_buflen) != namelog_buflen ||
+	    fdatasync(fd) || rename(tmp, namelog_file) || fsync(namelog_parentfd)) {
+		log_print("namelog: compaction failed: %s\n", strerror(errno));
+		close(fd);
+		unlink(tmp);
+		/* retry once the log grew by another NAMELOG_COMPACT bytes */
+		namelog_size = 0;
+		return;
+	}
+	close(namelog_fd);
+	namelog_fd = fd;
+	namelog_size = namelog_buflen;
+	namelog_buflen = 0;
+}
+
+static void *namelog_commit_thread(void *arg)
+{
+	char *buf = NULL;
+	size_t len, size = 0;
+
+	pthread_mutex_lock(&namelog_mutex);
+	for (;;) {
+		while (!namelog_buflen && !namelog_stop &&
+		       (namelog_size < NAMELOG_COMPACT || namelog_queue || namelog_busy))
+			pthread_cond_wait(&namelog_commit_cond, &namelog_mutex);
+		if (!namelog_buflen && namelog_stop)
+			break;
+		if (namelog_buflen && !namelog_stop) {
+			pthread_mutex_unlock(&namelog_mutex);
+			namelog_sleep(NAMELOG_COMMIT_DELAY);
+			pthread_mutex_lock(&namelog_mutex);
+		}
+		if (!namelog_buflen) {
+			/* everything is materialized, make sure it is durable
+			 * before the log is thrown away */
+			pthread_mutex_unlock(&namelog_mutex);
+			syncfs(namelog_dirfd);
+			pthread_mutex_lock(&namelog_mutex);
+			if (!namelog_queue && !namelog_busy && !namelog_buflen)
+				namelog_compact();
+			continue;
+		}
+		/* swap buffers, records appended from now on form the next batch */
+		char *tmpbuf = namelog_buf;
+		size_t tmpsize = namelog_bufsize;
+		namelog_buf = buf;
+		namelog_bufsize = size;
+		buf = tmpbuf;
+		size = tmpsize;
+		len = namelog_buflen;
+		namelog_buflen = 0;
+		pthread_mutex_unlock(&namelog_mutex);
+		if (write(namelog_fd, buf, len) != len || fdatasync(namelog_fd))
+			log_print("namelog: %s\n", strerror(errno));
+		pthread_mutex_lock(&namelog_mutex);
+		namelog_size += len;
+	}
+	pthread_mutex_unlock(&namelog_mutex);
+	free(buf);
+	return NULL;
+}
+
+static void *namelog_materialize_thread(void *arg)
+{
+	struct namelog_entry *e;
+	char name[FILENAME_MAX];
+	ssize_t len;
+
+	pthread_mutex_lock(&namelog_mutex);
+	for (;;) {
+		while (!namelog_queue && !namelog_stop) {
+			namelog_busy = false;
+			/* let the committer check whether the log can be compacted */
+			pthread_cond_signal(&namelog_commit_cond);
+			pthread_cond_wait(&namelog_work_cond, &namelog_mutex);
+		}
+		if (!namelog_queue)
+			break;
+		pthread_mutex_unlock(&namelog_mutex);
+		if (!namelog_stop)
+			namelog_sleep(NAMELOG_MATERIALIZE_DELAY);
+		pthread_mutex_lock(&namelog_mutex);
+		namelog_batch = namelog_queue;
+		namelog_queue = NULL;
+		namelog_tail = &namelog_queue;
+		namelog_busy = true;
+		pthread_mutex_unlock(&namelog_mutex);
+
+		/* a rename only waits for the entry at hand, it rewrites the
+		 * paths of the remaining ones in the batch */
+		for (;;) {
+			pthread_rwlock_rdlock(&namelog_rename_lock);
+			pthread_mutex_lock(&namelog_mutex);
+			if ((e = namelog_batch))
+				namelog_batch = e->next;
+			pthread_mutex_unlock(&namelog_mutex);
+			if (!e) {
+				pthread_rwlock_unlock(&namelog_rename_lock);
+				break;
+			}
+			/* skip names which were superseded in the meantime */
+			len = hashmap_get(namelog_pending, e->path, strlen(e->path), name, sizeof name);
+			if (len > 0 && len <= sizeof name && !strcmp(name, e->name)) {
+				if (lsetxattr(e->path, CIOPFS_ATTR_NAME, e->name, strlen(e->name), 0) &&
+				    errno != ENOENT)
+					debug("namelog: %s: %s\n", e->path, strerror(errno));
+				cache_invalidate(e->path);
+				pthread_mutex_lock(&namelog_mutex);
+				len = hashmap_get(namelog_pending, e->path, strlen(e->path), name, sizeof name);
+				if (len > 0 && len <= sizeof name && !strcmp(name, e->name))
+					hashmap_del(namelog_pending, e->path, strlen(e->path));
+				pthread_mutex_unlock(&namelog_mutex);
+			}
+			pthread_rwlock_unlock(&namelog_rename_lock);
+			free(e);
+		}
+		pthread_mutex_lock(&namelog_mutex);
+	}
+	namelog_busy = false;
+	pthread_mutex_unlock(&namelog_mutex);
+	return NULL;
+}
+
+/* applies the records of the log to the queue of pending names */
+static void namelog_replay(void)
+{
+	struct namelog_header h;
+	struct stat st;
+	char *buf, *rec, *a, *b;
+	size_t off = 0, n = 0;
+
+	if (fstat(namelog_fd, &st) || !st.st_size)
+		return;
+	if (!(buf = malloc(st.st_size)) || pread(namelog_fd, buf, st.st_size, 0) != st.st_size) {
+		log_print("namelog: could not read %s\n", namelog_file);
+		free(buf);
+		return;
+	}
+	while (off + sizeof(h) <= st.st_size) {
+		memcpy(&h, buf + off, sizeof(h));
+		rec = buf + off + sizeof(h);
+		if (h.len < 2 || h.len > st.st_size - off - sizeof(h) ||
+		    h.hash != hash_bytes(rec, h.len) || rec[h.len - 1])
+			break;
+		a = rec + 1;
+		b = a + strlen(a) + 1;
+		switch (rec[0]) {
+			case NAMELOG_SET:
+				if (b < rec + h.len)
+					namelog_enqueue(a, b);
+				break;
+			case NAMELOG_DEL:
+				hashmap_del(namelog_pending, a, strlen(a));
+				break;
+			case NAMELOG_RENAME:
+				if (b < rec + h.len)
+					namelog_rewrite(a, b);
+				break;
+		}
+		off += sizeof(h) + h.len;
+		n++;
+	}
+	if (off < st.st_size)
+		log_print("namelog: ignoring %zu bytes of incomplete records\n",
+		          (size_t)st.st_size - off);
+	log_print("namelog: replayed %zu records\n", n);
+	free(buf);
+	/* drop records of names which were deleted */
+	struct namelog_entry *e, **prev = &namelog_queue;
+	char name[FILENAME_MAX];
+	while ((e = *prev)) {
+		ssize_t len = hashmap_get(namelog_pending, e->path, strlen(e->path), name, sizeof name);
+		if (len > 0 && len <= sizeof name && !strcmp(name, e->name)) {
+			prev = &e->next;
+		} else {
+			*prev = e->next;
+			free(e);
+		}
+	}
+	namelog_tail = prev;
+	namelog_compact();
+}
+
+static bool namelog_init(void)
+{
+	char dir[PATH_MAX], *slash;
+	if (!namelog_file)
+		return true;
+	snprintf(dir, sizeof dir, "%s", namelog_file);
+	if (!(slash = strrchr(dir, '/')))
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+	if ((namelog_parentfd = open(dir, O_RDONLY)) == -1 ||
+	    (namelog_fd = open(namelog_file, O_RDWR | O_CREAT | O_APPEND, 0600)) == -1 ||
+	    fsync(namelog_parentfd) ||
+	    (namelog_dirfd = open(".", O_RDONLY)) == -1 ||
+	    !(namelog_pending = hashmap_new("namelog", 0)))
+		return false;
+	pthread_mutex_lock(&namelog_mutex);
+	namelog_replay();
+	pthread_mutex_unlock(&namelog_mutex);
+	if (pthread_create(&namelog_committer, NULL, namelog_commit_thread, NULL) ||
+	    pthread_create(&namelog_materializer, NULL, namelog_materialize_thread, NULL))
+		return false;
+	return true;
+}
+
+/* materializes all names and empties the log */
+static void namelog_destroy(void)
+{
+	if (!namelog_pending)
+		return;
+	pthread_mutex_lock(&namelog_mutex);
+	namelog_stop = true;
+	pthread_cond_signal(&namelog_work_cond);
+	pthread_mutex_unlock(&namelog_mutex);
+	pthread_join(namelog_materializer, NULL);
+	pthread_mutex_lock(&namelog_mutex);
+	pthread_cond_signal(&namelog_commit_cond);
+	pthread_mutex_unlock(&namelog_mutex);
+	pthread_join(namelog_committer, NULL);
+	if (!syncfs(namelog_dirfd) && !ftruncate(namelog_fd, 0))
+		fdatasync(namelog_fd);
+}
+
+/* lowers the CPU and I/O priority of a background thread below that of
+ * the threads serving requests */
+static void thread_set_idle(void)
+{
+	thread_background = true;
+	/* don't inherit the CPUs of the worker which started the thread */
+	if (affinity_nsets > 1)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity_allowed);
+#ifdef SCHED_IDLE
+	struct sched_param param = { 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+#ifdef SYS_ioprio_set
+	/* IOPRIO_WHO_PROCESS with id 0 refers to the calling thread */
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
+}
+
+/* Bloom filter of the inodes with a mixed case original name (`-o bloom=FILE').
+ *
+ * readdir only looks up the original names of entries whose inode number
+ * may be in the filter. The filter is a shared mapping of the file and thus
+ * persists across mounts. Bits are only ever set, inodes which lost their
+ * original name or were deleted remain as false positives.
+ *
+ * The file is marked dirty while mounted. A filter which doesn't exist, has
+ * a different size or wasn't cleanly unmounted is rebuilt by walking the
+ * whole source directory in the background, until then it isn't used.
+ * Deleting the file forces a rebuild after the source directory was
+ * modified without ciopfs.
+ *
+ * Names are added with the st_ino of the file but looked up with the d_ino
+ * of its directory entry. The filter is disabled on file systems where the
+ * two may differ, like overlayfs or FUSE, and if a mismatch shows up in the
+ * source directory or while rebuilding.
+ */
+
+#define BLOOM_MAGIC "ciopfsb"
+#define BLOOM_HASHES 7
+#define OVERLAYFS_MAGIC 0x794c7630
+#define FUSE_MAGIC 0x65735546
+
+struct bloom_header {
+	char magic[8];
+	uint64_t nbits;    /* a power of two */
+	uint32_t dirty;
+	uint32_t pad;
+	uint64_t bits[];
+};
+
+static char *bloom_file;
+/* size of the bit array in bytes (`-o bloom_size=') */
+static size_t bloom_size = 1 << 20;
+static struct bloom_header *bloom;
+static bool bloom_valid, bloom_stop, bloom_mismatch;
+static pthread_t bloom_builder;
+static bool bloom_building;
+
+static inline uint64_t bloom_hash(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static void bloom_add(ino_t ino)
+{
+	uint64_t h = bloom_hash(ino), step = (h >> 32) | 1, bit;
+	int i;
+	if (!bloom)
+		return;
+	for (i = 0; i < BLOOM_HASHES; i++, h += step) {
+		bit = h & (bloom->nbits - 1);
+		__atomic_fetch_or(&bloom->bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+	}
+}
+
+/* whether the inode may have a mixed case original name */
+static bool bloom_test(ino_t ino)
+{
+	uint64_t h = bloom_hash(ino), step = (h >> 32) | 1, bit;
+	int i;
+	if (!bloom || !__atomic_load_n(&bloom_valid, __ATOMIC_ACQUIRE))
+		return true;
+	for (i = 0; i < BLOOM_HASHES; i++, h += step) {
+		bit = h & (bloom->nbits - 1);
+		if (!(__atomic_load_n(&bloom->bits[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+/* adds all entries below path which have a mixed case original name, the
+ * inode numbers are taken from the directory entries as in readdir */
+static void bloom_walk(char *path, size_t len)
+{
+	char attrbuf[FILENAME_MAX];
+	struct dirent *de;
+	struct stat st;
+	ssize_t res;
+	size_t n;
+	DIR *dp = opendir(path);
+	if (!dp)
+		return;
+	while (!bloom_stop && !bloom_mismatch && (de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		    !name_is_folded(de->d_name))
+			continue;
+		n = strlen(de->d_name);
+		if (len + n + 1 >= PATH_MAX)
+			continue;
+		path[len] = '/';
+		memcpy(path + len + 1, de->d_name, n + 1);
+		res = lgetxattr(path, CIOPFS_ATTR_NAME, attrbuf, sizeof(attrbuf) - 1);
+		if (res > 0) {
+			attrbuf[res] = '\0';
+			if (strcmp(attrbuf, de->d_name)) {
+				if (!lstat(path, &st) && st.st_ino != de->d_ino) {
+					bloom_mismatch = true;
+					break;
+				}
+				bloom_add(de->d_ino);
+			}
+		}
+		if (de->d_type == DT_DIR ||
+		    (de->d_type == DT_UNKNOWN && !lstat(path, &st) && S_ISDIR(st.st_mode)))
+			bloom_walk(path, len + n + 1);
+		path[len] = '\0';
+		arena_reset();
+	}
+	closedir(dp);
+}
+
+static void *bloom_build_thread(void *arg)
+{
+	char path[PATH_MAX] = ".";
+	thread_set_idle();
+	log_print("bloom: rebuilding %s\n", bloom_file);
+	bloom_walk(path, 1);
+	if (bloom_mismatch)
+		log_print("bloom: inode numbers of directory entries differ, "
+		          "filter disabled\n");
+	else if (!bloom_stop) {
+		__atomic_store_n(&bloom_valid, true, __ATOMIC_RELEASE);
+		log_print("bloom: rebuilt %s\n", bloom_file);
+	}
+	return NULL;
+}
+
+/* whether the d_ino of directory entries in the source directory matches
+ * the st_ino of the files, only the top level entries are sampled */
+static bool bloom_inodes_match(void)
+{
+	struct dirent *de;
+	struct stat st;
+	bool match = true;
+	int n = 0;
+	DIR *dp;
+#ifdef __linux__
+	struct statfs sf;
+	if (!statfs(".", &sf) &&
+	    (sf.f_type == OVERLAYFS_MAGIC || sf.f_type == FUSE_MAGIC))
+		return false;
+#endif
+	if (!(dp = opendir(".")))
+		return true;
+	while (match && n++ < 256 && (de = readdir(dp))) {
+		if (strcmp(de->d_name, "..") && !lstat(de->d_name, &st))
+			match = st.st_ino == de->d_ino;
+	}
+	closedir(dp);
+	return match;
+}
+
+static bool bloom_init(void)
+{
+	size_t size;
+	struct stat st;
+	bool rebuild;
+	int fd;
+
+	if (!bloom_file)
+		return true;
+	if (!bloom_inodes_match()) {
+		log_print("bloom: inode numbers of directory entries differ, "
+		          "filter disabled\n");
+		return true;
+	}
+	/* the bit array is a power of two of at least 64 bits */
+	while (bloom_size & (bloom_size - 1))
+		bloom_size &= bloom_size - 1;
+	if (bloom_size < 8)
+		bloom_size = 8;
+	size = sizeof(*bloom) + bloom_size;
+	if ((fd = open(bloom_file, O_RDWR | O_CREAT, 0600)) == -1 || fstat(fd, &st))
+		goto err;
+	rebuild = st.st_size != size;
+	if (rebuild && (ftruncate(fd, 0) || ftruncate(fd, size)))
+		goto err;
+	if ((bloom = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		bloom = NULL;
+		goto err;
+	}
+	close(fd);
+	if (memcmp(bloom->magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC)) ||
+	    bloom->nbits != bloom_size * 8 || bloom->dirty) {
+		rebuild = true;
+		memset(bloom->bits, 0, bloom_size);
+		memcpy(bloom->magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC));
+		bloom->nbits = bloom_size * 8;
+	}
+	bloom->dirty = 1;
+	if (msync(bloom, size, MS_SYNC))
+		return false;
+	if (!rebuild) {
+		bloom_valid = true;
+		return true;
+	}
+	bloom_building = !pthread_create(&bloom_builder, NULL, bloom_build_thread, NULL);
+	return true;
+err:
+	if (fd != -1)
+		close(fd);
+	return false;
+}
+
+/* marks the filter clean unless it is incomplete */
+static void bloom_destroy(void)
+{
+	size_t size = sizeof(*bloom) + bloom_size;
+	if (!bloom)
+		return;
+	if (bloom_building) {
+		bloom_stop = true;
+		pthread_join(bloom_builder, NULL);
+	}
+	if (bloom_valid && !msync(bloom, size, MS_SYNC)) {
+		bloom->dirty = 0;
+		msync(bloom, size, MS_SYNC);
+	}
+	munmap(bloom, size);
+	bloom = NULL;
+}
+
+/* Looks up the original name of path. If valid isn't NULL it tells whether
+ * the name is known to match path: pending names and those from the snapshot
+ * always do, cached ones once they were validated.
+ */
+static ssize_t ciopfs_get_orig_name(const char *path, char *value, size_t size, bool *valid)
+{
+	ssize_t attrlen;
+	int flags = 0;
+	unsigned long gen = cache_gen();
+	debug("looking up original file name of %s ", path);
+	if (valid)
+		*valid = true;
+	if ((attrlen = namelog_get(path, value, size)) > 0) {
+		debug("found pending %s\n", value);
+		return attrlen;
+	}
+	if (snapshot_get(path, value, size - 1, &attrlen)) {
+		/* stale names were skipped when the snapshot was saved */
+	} else if (xattr_cache_get(path, CIOPFS_ATTR_NAME, value, size - 1, &attrlen, &flags)) {
+		if (valid)
+			*valid = flags & XATTR_CACHE_VALID;
+	} else {
+		attrlen = lgetxattr(path, CIOPFS_ATTR_NAME, value, size - 1);
+		xattr_cache_put(path, CIOPFS_ATTR_NAME, value, attrlen == -1 ? -errno : attrlen, gen);
+		if (valid)
+			*valid = false;
+	}
+	if (attrlen > 0) {
+		value[attrlen] = '\0';
+		debug("found %s\n", value);
+	} else {
+		debug("nothing found\n");
+	}
+	return attrlen;
+}
+
+/* With `-o dirflags' a directory whose entries all have their folded name
+ * as original name carries CIOPFS_CLEAN_ATTR_NAME and readdir skips the
+ * per entry lookups. The flag is set by a complete listing and removed,
+ * with the directory locked, before a mixed case name is stored. A listing
+ * only sets it if the generation of its lock stripe didn't change meanwhile.
+ */
+static unsigned long dir_gens[DIR_LOCKS];
+
+/* called with the directory of the folded path locked */
+static void dir_flag_clear(const char *path, const char *filename)
+{
+	const char *s = strrchr(path, '/');
+	char *dir = ".";
+	if (!dirflags || name_is_folded(filename))
+		return;
+	__atomic_add_fetch(&dir_gens[dir_lock_index(path)], 1, __ATOMIC_RELAXED);
+	if (s && (dir = arena_alloc(s - path + 1))) {
+		memcpy(dir, path, s - path);
+		dir[s - path] = '\0';
+	}
+	/* checking first avoids a metadata update in the common case */
+	if (dir && lgetxattr(dir, CIOPFS_CLEAN_ATTR_NAME, NULL, 0) != -1)
+		lremovexattr(dir, CIOPFS_CLEAN_ATTR_NAME);
+}
+
+static int ciopfs_set_orig_name_fd(int fd, const char *origpath)
+{
+	char *filename = strrchr(origpath, '/');
+	if (!filename)
+		filename = (char *)origpath;
+	else
+		filename++;
+	if (bloom && !name_is_folded(filename)) {
+		struct stat st;
+		if (!fstat(fd, &st))
+			bloom_add(st.st_ino);
+	}
+	if (namelog_pending || dirflags) {
+		char *path = map_path(origpath);
+		if (!path)
+			return -ENOMEM;
+		dir_flag_clear(path, filename);
+		if (namelog_pending)
+			return namelog_set(path, filename);
+	}
+#ifndef NDEBUG
+	char *path = map_path(origpath);
+	if (likely(path != NULL))
+		log_print("storing original name '%s' in '%s'\n", filename, path);
+#endif
+	if (fsetxattr(fd, CIOPFS_ATTR_NAME, filename, strlen(filename), 0)) {
+		int ret = -errno;
+		debug("%s\n", strerror(errno));
+		return ret;
+	}
+	return 0;
+}
+
+static int ciopfs_set_orig_name_path(const char *path, const char *origpath)
+{
+	char *filename = strrchr(origpath, '/');
+	if (!filename)
+		filename = (char *)origpath;
+	else
+		filename++;
+	debug("storing original name '%s' in '%s'\n", filename, path);
+	if (bloom && !name_is_folded(filename)) {
+		struct stat st;
+		if (!lstat(path, &st))
+			bloom_add(st.st_ino);
+	}
+	dir_flag_clear(path, filename);
+	if (namelog_pending)
+		return namelog_set(path, filename);
+	/* XXX: setting an extended attribute on a symlink doesn't seem to work (EPERM) */
+	if (lsetxattr(path, CIOPFS_ATTR_NAME, filename, strlen(filename), 0)) {
+		int ret = -errno;
+		debug("%s\n", strerror(errno));
+		return ret;
+	}
+	return 0;
+}
+
+static int ciopfs_remove_orig_name(const char *path)
+{
+	debug("removing original file name of %s\n", path);
+	namelog_forget(path);
+	return lremovexattr(path, CIOPFS_ATTR_NAME);
+}
+
+/* checks whether the original name orig still matches the folded name */
+static bool ciopfs_orig_name_matches(const char *orig, const char *name)
+{
+	char foldbuf[FILENAME_MAX];
+	return fold_name(orig, foldbuf, sizeof foldbuf, NULL) < sizeof foldbuf &&
+	       !strcmp(foldbuf, name);
+}
+
+/* Removes the original name of path which was found to be inaccurate,
+ * unless it was updated by a concurrent operation in the meantime.
+ */
+static void ciopfs_remove_stale_orig_name(const char *path, const char *name)
+{
+	char attrbuf[FILENAME_MAX];
+	dir_lock(path);
+	if (ciopfs_get_orig_name(path, attrbuf, sizeof attrbuf, NULL) > 0 &&
+	    !ciopfs_orig_name_matches(attrbuf, name)) {
+		ciopfs_remove_orig_name(path);
+		cache_invalidate(path);
+	}
+	dir_unlock(path);
+}
+
+static int ciopfs_getattr(const char *path, struct stat *st_data)
+{
+	int res;
+	unsigned long gen = cache_gen();
+	char *p = map_path(path);
+	if (unlikely(p == NULL))
+		return -ENOMEM;
+	if (attr_cache_get(p, st_data, &res)) {
+		arena_reset();
+		return res;
+	}
+	enter_user_context_effective();
+	res = lstat(p, st_data);
+	if (res == -1)
+		res = -errno;
+	leave_user_context_effective();
+	attr_cache_put(p, st_data, res, gen);
+	arena_reset();
+	return res;
+}
+
+static int ciopfs_fgetattr(const char *path, struct stat *stbuf,
+                           struct fuse_file_info *fi)
+{
+	int res;
+	if (attr_cache) {
+		char *p = map_path(path);
+		if (p && attr_cache_get(p, stbuf, &res) && !res) {
+			arena_reset();
+			return res;
+		}
+	}
+	enter_user_context_effective();
+	res = fstat(fi->fh, stbuf);
+	if (res == -1)
+		res = -errno;
+	leave_user_context_effective();
+	arena_reset();
+	return res;
+}
+
+static int ciopfs_readlink(const char *path, char *buf, size_t size)
+{
+	int ret;
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
@@ -390,28 +2181,523 @@ static int ciopfs_readlink(const char *path, char *buf, size_t size)
 	if (res == -1)
 		ret = -errno;
 	leave_user_context_effective();
-	free(p);
+	arena_reset();
 	if (res == -1)
 		return ret;
 	buf[res] = '\0';
 	return 0;
 }
 
+/* Cache of directory listings (`-o dir_cache=SIZE').
+ *
+ * A listing holds the folded name, the type, the inode number and, if it
+ * differs, the original name of every entry. Listings are stored in a
+ * single block per directory. The entries are sorted and front coded:
+ * every name only stores the suffix which differs from its predecessor.
+ * Directories typically contain many names with long common prefixes
+ * which shrinks the listings considerably, readdir decodes the block
+ * sequentially.
+ *
+ *   varint  length of the prefix shared with the previous name
+ *   varint  length of the suffix
+ *   bytes   suffix
+ *   byte    d_type, DIR_CACHE_ORIG is set if an original name follows
+ *   varint  inode number
+ *   varint  length of the original name      (optional)
+ *   bytes   original name                    (optional)
+ *
+ * A listing is built while a directory is read from start to end with
+ * the same handle. It is used by subsequent opendir calls as long as
+ * the inode number and modification time of the directory are unchanged.
+ * Directories which were modified within the last second aren't cached
+ * because a change in the same clock tick wouldn't be noticed.
+ */
+
+#define DIR_CACHE_ORIG 0x80
+
+struct dir_listing {
+	uint64_t ino;
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t nentries;
+	char entries[];
+};
+
+/* an entry which was read but not yet encoded */
+struct dir_raw_entry {
+	uint64_t ino;
+	uint8_t type;
+	uint16_t namelen, origlen;
+	char data[];  /* name and original name, both NUL terminated */
+};
+
+struct dir_builder {
+	char *buf;        /* raw entries */
+	size_t len, size;
+	size_t *entries;  /* offsets of the raw entries */
+	size_t nentries, maxentries;
+};
+
+/* per handle state of an open directory */
+struct ciopfs_dir {
+	DIR *dp;
+	struct stat st;             /* of the directory when it was opened */
+	struct dir_listing *listing;/* cached listing which is served */
+	size_t listlen;
+	size_t pos;                 /* of the next entry to decode */
+	uint32_t index;             /* of the next entry to decode */
+	char name[FILENAME_MAX];    /* previously decoded name */
+	bool building;              /* whether a listing is built from dp */
+	unsigned long build_gen;    /* of the caches when the directory was opened */
+	bool scanning;              /* whether a listing may set the dir flag */
+	unsigned long gen;          /* of the lock stripe when scanning started */
+	off_t next;                 /* offset expected by the next readdir */
+	struct dir_builder builder;
+};
+
+static bool dir_cache_init(void)
+{
+	if (!dir_cache_size)
+		return true;
+	return (dir_cache = hashmap_new("dir_cache", dir_cache_size));
+}
+
+static inline size_t varint_put(char *buf, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	return n;
+}
+
+/* decodes a varint from buf which ends at end, returns 0 if it is truncated */
+static inline size_t varint_get(const char *buf, const char *end, uint64_t *v)
+{
+	size_t n = 0;
+	int shift = 0;
+	*v = 0;
+	while (buf + n < end && shift < 64) {
+		unsigned char c = buf[n++];
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return n;
+		shift += 7;
+	}
+	return 0;
+}
+
+static bool dir_builder_add(struct dir_builder *b, const char *name, const char *orig,
+                            uint64_t ino, unsigned char type)
+{
+	size_t namelen = strlen(name), origlen = strcmp(name, orig) ? strlen(orig) : 0;
+	size_t size = (sizeof(struct dir_raw_entry) + namelen + origlen + 2 + 7) & ~(size_t)7;
+	struct dir_raw_entry *e;
+
+	if (b->len + size > b->size) {
+		size_t n = b->size ? b->size * 2 : 16384;
+		char *buf;
+		while (b->len + size > n)
+			n *= 2;
+		if (!(buf = realloc(b->buf, n)))
+			return false;
+		b->buf = buf;
+		b->size = n;
+	}
+	if (b->nentries == b->maxentries) {
+		size_t n = b->maxentries ? b->maxentries * 2 : 256;
+		size_t *entries = realloc(b->entries, n * sizeof(*entries));
+		if (!entries)
+			return false;
+		b->entries = entries;
+		b->maxentries = n;
+	}
+	e = (struct dir_raw_entry *)(b->buf + b->len);
+	e->ino = ino;
+	e->type = type;
+	e->namelen = namelen;
+	e->origlen = origlen;
+	memcpy(e->data, name, namelen + 1);
+	memcpy(e->data + namelen + 1, orig, origlen);
+	e->data[namelen + 1 + origlen] = '\0';
+	b->entries[b->nentries++] = b->len;
+	b->len += size;
+	return true;
+}
+
+static int dir_raw_entry_cmp(const void *a, const void *b, void *buf)
+{
+	return strcmp(((struct dir_raw_entry *)((char *)buf + *(const size_t *)a))->data,
+	              ((struct dir_raw_entry *)((char *)buf + *(const size_t *)b))->data);
+}
+
+/* Encodes the entries of the builder into a listing, returns its length
+ * or 0 if there is not enough memory.
+ */
+static size_t dir_builder_finish(struct dir_builder *b, const struct stat *st,
+                                 struct dir_listing **listing)
+{
+	struct dir_listing *l;
+	const char *prev = "";
+	size_t i, len, prevlen = 0;
+
+	/* raw entries have room for all but the varints and the type */
+	if (!(l = malloc(sizeof(*l) + b->len + b->nentries * 3 * 10)))
+		return 0;
+	qsort_r(b->entries, b->nentries, sizeof(*b->entries), dir_raw_entry_cmp, b->buf);
+	l->ino = st->st_ino;
+	l->mtime_sec = st->st_mtim.tv_sec;
+	l->mtime_nsec = st->st_mtim.tv_nsec;
+	l->nentries = b->nentries;
+	for (i = 0, len = 0; i < b->nentries; i++) {
+		struct dir_raw_entry *e = (struct dir_raw_entry *)(b->buf + b->entries[i]);
+		size_t shared = 0;
+		while (shared < prevlen && shared < e->namelen && prev[shared] == e->data[shared])
+			shared++;
+		len += varint_put(l->entries + len, shared);
+		len += varint_put(l->entries + len, e->namelen - shared);
+		memcpy(l->entries + len, e->data + shared, e->namelen - shared);
+		len += e->namelen - shared;
+		l->entries[len++] = e->type | (e->origlen ? DIR_CACHE_ORIG : 0);
+		len += varint_put(l->entries + len, e->ino);
+		if (e->origlen) {
+			len += varint_put(l->entries + len, e->origlen);
+			memcpy(l->entries + len, e->data + e->namelen + 1, e->origlen);
+			len += e->origlen;
+		}
+		prev = e->data;
+		prevlen = e->namelen;
+	}
+	*listing = l;
+	return sizeof(*l) + len;
+}
+
+static void dir_builder_free(struct dir_builder *b)
+{
+	free(b->buf);
+	free(b->entries);
+	memset(b, 0, sizeof(*b));
+}
+
+/* Decodes the entry at d->pos into name, orig and st. Returns the position
+ * of the next entry or 0 if the listing is corrupt.
+ */
+static size_t dir_listing_decode(struct ciopfs_dir *d, char *name, char *orig,
+                                 struct stat *st)
+{
+	const char *buf = (const char *)d->listing, *end = buf + d->listlen;
+	const char *s = buf + d->pos;
+	uint64_t shared, len, ino;
+	size_t n;
+	unsigned char type;
+
+	if (!(n = varint_get(s, end, &shared)) || shared >= FILENAME_MAX)
+		return 0;
+	s += n;
+	if (!(n = varint_get(s, end, &len)) || shared + len >= FILENAME_MAX ||
+	    len > end - s - n)
+		return 0;
+	s += n;
+	memcpy(name, d->name, shared);
+	memcpy(name + shared, s, len);
+	name[shared + len] = '\0';
+	s += len;
+	if (s >= end)
+		return 0;
+	type = *s++;
+	if (!(n = varint_get(s, end, &ino)))
+		return 0;
+	s += n;
+	if (type & DIR_CACHE_ORIG) {
+		if (!(n = varint_get(s, end, &len)) || len >= FILENAME_MAX || len > end - s - n)
+			return 0;
+		s += n;
+		memcpy(orig, s, len);
+		orig[len] = '\0';
+		s += len;
+	} else {
+		strcpy(orig, name);
+	}
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = (type & ~DIR_CACHE_ORIG) << 12;
+	return s - buf;
+}
+
+/* looks up a cached listing of the folded path p which is still valid */
+static void dir_cache_lookup(struct ciopfs_dir *d, const char *p)
+{
+	char buf[16384];
+	struct dir_listing *l = (struct dir_listing *)buf;
+	ssize_t len = hashmap_get(dir_cache, p, strlen(p), buf, sizeof buf);
+
+	if (len < (ssize_t)sizeof(*l))
+		return;
+	if (l->ino != d->st.st_ino || l->mtime_sec != d->st.st_mtim.tv_sec ||
+	    l->mtime_nsec != d->st.st_mtim.tv_nsec)
+		return;
+	if (!(l = malloc(len)))
+		return;
+	if (len <= sizeof buf)
+		memcpy(l, buf, len);
+	/* the listing might have been replaced in the meantime */
+	else if (hashmap_get(dir_cache, p, strlen(p), l, len) != len ||
+	         l->ino != d->st.st_ino || l->mtime_sec != d->st.st_mtim.tv_sec ||
+	         l->mtime_nsec != d->st.st_mtim.tv_nsec) {
+		free(l);
+		return;
+	}
+	d->listing = l;
+	d->listlen = len;
+	d->pos = offsetof(struct dir_listing, entries);
+}
+
+/* Writing the snapshot at unmount, see the description above. */
+
+struct snapshot_writer {
+	FILE *file;
+	uint32_t ndirs;
+	char *buf;             /* strings of the block under construction */
+	size_t len, size;
+	struct snapshot_entry *entries;
+	size_t nentries, maxentries;
+};
+
+/* appends s to the block under construction and returns its offset */
+static uint32_t snapshot_add_string(struct snapshot_writer *w, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t off = w->len;
+	if (w->len + len + 8 > w->size) {
+		size_t size = w->size ? w->size * 2 : 65536;
+		char *buf;
+		while (w->len + len + 8 > size)
+			size *= 2;
+		if (!(buf = realloc(w->buf, size)))
+			return 0;
+		w->buf = buf;
+		w->size = size;
+	}
+	memcpy(w->buf + w->len, s, len);
+	w->len += len;
+	return off;
+}
+
+/* appends an entry to the block under construction, orig is NULL if the
+ * entry has no original name */
+static bool snapshot_add_entry(struct snapshot_writer *w, const char *name, const char *orig)
+{
+	struct snapshot_entry *e;
+	if (w->nentries == w->maxentries) {
+		size_t n = w->maxentries ? w->maxentries * 2 : 1024;
+		if (!(e = realloc(w->entries, n * sizeof(*e))))
+			return false;
+		w->entries = e;
+		w->maxentries = n;
+	}
+	e = &w->entries[w->nentries];
+	e->name = snapshot_add_string(w, name);
+	e->orig = orig ? snapshot_add_string(w, orig) : 0;
+	if (!e->name || (orig && !e->orig))
+		return false;
+	w->nentries++;
+	return true;
+}
+
+/* writes the block under construction whose entries were added in order */
+static void snapshot_write_block(struct snapshot_writer *w, const struct dir_listing *l)
+{
+	struct snapshot_dir d;
+	size_t i, hdrlen;
+
+	/* the entries precede the strings, shift their offsets accordingly */
+	hdrlen = sizeof(d) + w->nentries * sizeof(struct snapshot_entry);
+	for (i = 0; i < w->nentries; i++) {
+		w->entries[i].name += hdrlen;
+		if (w->entries[i].orig)
+			w->entries[i].orig += hdrlen;
+	}
+	memset(&d, 0, sizeof(d));
+	d.ino = l->ino;
+	d.mtime_sec = l->mtime_sec;
+	d.mtime_nsec = l->mtime_nsec;
+	d.nentries = w->nentries;
+	d.size = (hdrlen + w->len + 7) & ~7;
+	memset(w->buf + w->len, 0, d.size - hdrlen - w->len);
+	if (fwrite(&d, sizeof(d), 1, w->file) == 1 &&
+	    fwrite(w->entries, sizeof(struct snapshot_entry), w->nentries, w->file) == w->nentries &&
+	    fwrite(w->buf, d.size - hdrlen, 1, w->file) == 1)
+		w->ndirs++;
+}
+
+/* whether the directory path still has the inode number and mtime */
+static bool snapshot_dir_unchanged(const char *path, uint64_t ino, int64_t sec, int64_t nsec)
+{
+	struct stat st;
+	return !lstat(path, &st) && st.st_ino == ino &&
+	       st.st_mtim.tv_sec == sec && st.st_mtim.tv_nsec == nsec;
+}
+
+/* writes the block of the directory dir from its listing in snapshot_dirs */
+static void snapshot_save_listing(const void *dir, size_t dirlen, const void *value,
+                                  size_t len, void *arg)
+{
+	struct snapshot_writer *w = arg;
+	struct dir_listing l;
+	struct ciopfs_dir d;
+	struct stat st;
+	char path[PATH_MAX], name[FILENAME_MAX], orig[FILENAME_MAX];
+	size_t next;
+	uint32_t i;
+
+	if (dirlen >= sizeof path || len < sizeof(l))
+		return;
+	memcpy(path, dir, dirlen);
+	path[dirlen] = '\0';
+	memcpy(&l, value, sizeof(l));
+	if (!snapshot_dir_unchanged(path, l.ino, l.mtime_sec, l.mtime_nsec))
+		return;
+	w->len = 0;
+	w->nentries = 0;
+	snapshot_add_string(w, path);
+	/* listings are sorted by folded name like the snapshot */
+	memset(&d, 0, sizeof(d));
+	d.listing = (struct dir_listing *)value;
+	d.listlen = len;
+	d.pos = offsetof(struct dir_listing, entries);
+	for (i = 0; i < l.nentries; i++) {
+		if (!(next = dir_listing_decode(&d, name, orig, &st)))
+			return;
+		d.pos = next;
+		strcpy(d.name, name);
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+		if (!snapshot_add_entry(w, name, strcmp(name, orig) ? orig : NULL))
+			return;
+	}
+	snapshot_write_block(w, &l);
+}
+
+/* copies the block of a directory from the previous snapshot which wasn't
+ * listed since the mount */
+static void snapshot_save_block(const void *dir, size_t dirlen, const void *value,
+                                size_t len, void *arg)
+{
+	struct snapshot_writer *w = arg;
+	const struct snapshot_dir *d;
+	const char *path;
+
+	if (len != sizeof(d) || hashmap_get(snapshot_dirs, dir, dirlen, NULL, 0) != -1)
+		return;
+	memcpy(&d, value, sizeof(d));
+	path = (const char *)((const struct snapshot_entry *)(d + 1) + d->nentries);
+	if (snapshot_dir_unchanged(path, d->ino, d->mtime_sec, d->mtime_nsec) &&
+	    fwrite(d, d->size, 1, w->file) == 1)
+		w->ndirs++;
+}
+
+/* writes the snapshot to a temporary file and atomically replaces the old one */
+static void snapshot_save(void)
+{
+	struct snapshot_writer w = { 0 };
+	struct snapshot_header h;
+	char tmp[PATH_MAX];
+
+	if (!snapshot_dirs)
+		return;
+	snprintf(tmp, sizeof tmp, "%s.tmp", snapshot_file);
+	if (!(w.file = fopen(tmp, "w"))) {
+		log_print("snapshot: %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	memset(&h, 0, sizeof(h));
+	fseek(w.file, sizeof(h), SEEK_SET);
+	hashmap_foreach(snapshot_dirs, snapshot_save_listing, &w);
+	hashmap_foreach(snapshot_index, snapshot_save_block, &w);
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	strncpy(h.policy, fold_ops->name, sizeof(h.policy));
+	h.nfc = normalize_nfc;
+	h.ndirs = w.ndirs;
+	rewind(w.file);
+	if (fwrite(&h, sizeof(h), 1, w.file) != 1 || fflush(w.file) ||
+	    fdatasync(fileno(w.file)) || fclose(w.file) || rename(tmp, snapshot_file)) {
+		log_print("snapshot: could not write %s: %s\n", snapshot_file, strerror(errno));
+		unlink(tmp);
+	}
+	free(w.buf);
+	free(w.entries);
+	if (snapshot_map)
+		munmap(snapshot_map, snapshot_size);
+}
+
 static int ciopfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	int ret;
+	int ret = 0;
+	struct ciopfs_dir *d;
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	if (!(d = calloc(1, sizeof(*d)))) {
+		arena_reset();
+		return -ENOMEM;
+	}
+	d->build_gen = cache_gen();
 	enter_user_context_effective();
-	DIR *dp = opendir(p);
-	if (dp == NULL)
+	d->dp = opendir(p);
+	if (d->dp == NULL || ((dir_cache || snapshot_dirs) && fstat(dirfd(d->dp), &d->st)))
 		ret = -errno;
 	leave_user_context_effective();
-	free(p);
-	if (dp == NULL)
+	if (ret) {
+		if (d->dp)
+			closedir(d->dp);
+		free(d);
+		arena_reset();
 		return ret;
-	fi->fh = (uint64_t)(uintptr_t)dp;
+	}
+	if (dir_cache)
+		dir_cache_lookup(d, p);
+	/* a cached listing is complete, keep it for the snapshot */
+	if (d->listing && snapshot_dirs &&
+	    hashmap_get(snapshot_dirs, p, strlen(p), NULL, 0) == -1)
+		hashmap_put(snapshot_dirs, p, strlen(p), d->listing, d->listlen);
+	if (dir_cache || snapshot_dirs)
+		d->building = !d->listing && d->st.st_mtim.tv_sec < time(NULL) - 1;
+	arena_reset();
+	fi->fh = (uint64_t)(uintptr_t)d;
+	return 0;
+}
+
+/* serves readdir from the cached listing, offsets are the positions of
+ * the following entry within the listing */
+static int ciopfs_readdir_cached(struct ciopfs_dir *d, void *buf, fuse_fill_dir_t filler,
+                                 off_t offset)
+{
+	char name[FILENAME_MAX], orig[FILENAME_MAX];
+	struct stat st;
+	size_t next;
+
+	if (offset != d->pos) {
+		d->pos = offsetof(struct dir_listing, entries);
+		d->index = 0;
+		d->name[0] = '\0';
+		while (d->pos < offset && d->index < d->listing->nentries) {
+			if (!(next = dir_listing_decode(d, name, orig, &st)))
+				return -EIO;
+			d->pos = next;
+			d->index++;
+			strcpy(d->name, name);
+		}
+	}
+	while (d->index < d->listing->nentries) {
+		if (!(next = dir_listing_decode(d, name, orig, &st)))
+			return -EIO;
+		if (filler(buf, orig, &st, next))
+			break;
+		d->pos = next;
+		d->index++;
+		strcpy(d->name, name);
+	}
 	return 0;
 }
 
@@ -419,8 +2705,16 @@ static int ciopfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi)
 {
 	int ret = 0;
-	DIR *dp = (DIR *)(uintptr_t)fi->fh;
+	struct ciopfs_dir *d = (struct ciopfs_dir *)(uintptr_t)fi->fh;
 	struct dirent *de;
+	off_t next;
+
+	if (!d)
+		return -EBADF;
+	if (d->listing)
+		return ciopfs_readdir_cached(d, buf, filler, offset);
+
+	DIR *dp = d->dp;
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
@@ -433,9 +2727,21 @@ static int ciopfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		goto out;
 	}
 
-	if (!dp) {
-		ret = -EBADF;
-		goto out;
+	/* a listing can only be built by reading sequentially */
+	if (offset != d->next && d->building) {
+		d->building = false;
+		dir_builder_free(&d->builder);
+	}
+
+	bool clean = false;
+	if (dirflags) {
+		clean = lgetxattr(p, CIOPFS_CLEAN_ATTR_NAME, NULL, 0) != -1;
+		if (offset == 0) {
+			d->scanning = !clean;
+			d->gen = __atomic_load_n(&dir_gens[dir_lock_index_dir(p)],
+			                         __ATOMIC_RELAXED);
+		} else if (offset != d->next)
+			d->scanning = false;
 	}
 
 	seekdir(dp, offset);
@@ -443,54 +2749,107 @@ static int ciopfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
 		char *dname;
-		char *attrlower;
 
-		/* skip any entry which is not all lower case for now */
-		if (str_contains_upper(de->d_name))
+		/* skip any entry which is not in folded form, it would be
+		 * inaccessible anyway */
+		if (!name_is_folded(de->d_name))
 			continue;
 
 		memset(&st, 0, sizeof(st));
 		st.st_ino = de->d_ino;
 		st.st_mode = de->d_type << 12;
 
-		if (!strcmp(".", de->d_name) || !strcmp("..", de->d_name))
+		if (clean || !bloom_test(de->d_ino) ||
+		    !strcmp(".", de->d_name) || !strcmp("..", de->d_name))
 			dname = de->d_name;
 		else {
 			/* check whether there is an original name associated with
 			 * this path and if so return it instead of the all lower
 			 * case one
 			 */
-			snprintf(dnamebuf, sizeof dnamebuf, "%s/%s", p, de->d_name);
+			child_path(dnamebuf, sizeof dnamebuf, p, de->d_name);
 			debug("dnamebuf: %s de->d_name: %s\n", dnamebuf, de->d_name);
-			if (ciopfs_get_orig_name(dnamebuf, attrbuf, sizeof attrbuf) > 0) {
+			unsigned long gen = cache_gen();
+			bool valid;
+			if (ciopfs_get_orig_name(dnamebuf, attrbuf, sizeof attrbuf, &valid) > 0) {
 				/* we found an original name now check whether it is
-				 * still accurate and if not remove it
+				 * still accurate and if not remove it, a validated
+				 * name remains so until the cache is invalidated
 				 */
-				attrlower = str_fold(attrbuf);
-				if (attrlower && !strcmp(attrlower, de->d_name))
+				if (valid || ciopfs_orig_name_matches(attrbuf, de->d_name)) {
 					dname = attrbuf;
-				else {
+					if (!valid)
+						xattr_cache_set_valid(dnamebuf, attrbuf, gen);
+					if (strcmp(attrbuf, de->d_name))
+						d->scanning = false;
+				} else {
 					dname = de->d_name;
-					ciopfs_remove_orig_name(dnamebuf);
+					ciopfs_remove_stale_orig_name(dnamebuf, de->d_name);
 				}
-				free(attrlower);
 			} else
 				dname = de->d_name;
 		}
 		debug("dname: %s\n", dname);
-		if (filler(buf, dname, &st, telldir(dp)))
+		next = telldir(dp);
+		if (filler(buf, dname, &st, next))
 			break;
+		d->next = next;
+		if (d->building &&
+		    !dir_builder_add(&d->builder, de->d_name, dname, de->d_ino, de->d_type)) {
+			d->building = false;
+			dir_builder_free(&d->builder);
+		}
 	}
 
+	if (!de && d->building) {
+		struct dir_listing *listing;
+		size_t len = dir_builder_finish(&d->builder, &d->st, &listing);
+		/* an invalidation during the scan, e.g. by a case only rename
+		 * which leaves the mtime alone, makes the listing stale */
+		if (len) {
+			if (d->build_gen == cache_gen()) {
+				if (dir_cache)
+					hashmap_put(dir_cache, p, pathlen, listing, len);
+				if (snapshot_dirs)
+					hashmap_put(snapshot_dirs, p, pathlen, listing, len);
+			}
+			if (d->build_gen != cache_gen()) {
+				if (dir_cache)
+					hashmap_del(dir_cache, p, pathlen);
+				if (snapshot_dirs)
+					hashmap_del(snapshot_dirs, p, pathlen);
+			}
+			free(listing);
+		}
+		d->building = false;
+		dir_builder_free(&d->builder);
+	}
+
+	if (!de && d->scanning) {
+		unsigned int i = dir_lock_index_dir(p);
+		pthread_mutex_lock(&dir_locks[i]);
+		if (__atomic_load_n(&dir_gens[i], __ATOMIC_RELAXED) == d->gen)
+			lsetxattr(p, CIOPFS_CLEAN_ATTR_NAME, "", 0, 0);
+		pthread_mutex_unlock(&dir_locks[i]);
+		d->scanning = false;
+	}
+
+
 out:
-	free(p);
+	arena_reset();
 	return ret;
 }
 
 static int ciopfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-	if (fi->fh)
-		closedir((DIR *)(uintptr_t)fi->fh);
+	struct ciopfs_dir *d = (struct ciopfs_dir *)(uintptr_t)fi->fh;
+	if (!d)
+		return 0;
+	if (d->dp)
+		closedir(d->dp);
+	dir_builder_free(&d->builder);
+	free(d->listing);
+	free(d);
 	return 0;
 }
 
@@ -500,6 +2859,7 @@ static int ciopfs_mknod(const char *path, mode_t mode, dev_t rdev)
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	dir_lock(p);
 	enter_user_context_effective();
 	/* On Linux this could just be 'mknod(p, mode, rdev)' but this
 	   is more portable */
@@ -517,7 +2877,9 @@ static int ciopfs_mknod(const char *path, mode_t mode, dev_t rdev)
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	dir_unlock(p);
+	arena_reset();
 	return res;
 }
 
@@ -526,6 +2888,7 @@ static int ciopfs_mkdir(const char *path, mode_t mode)
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	dir_lock(p);
 	enter_user_context_effective();
 	int res = mkdir(p, mode);
 	if (res == -1)
@@ -533,7 +2896,9 @@ static int ciopfs_mkdir(const char *path, mode_t mode)
 	leave_user_context_effective();
 	if (res == 0)
 		ciopfs_set_orig_name_path(p, path);
-	free(p);
+	cache_invalidate(p);
+	dir_unlock(p);
+	arena_reset();
 	return res;
 }
 
@@ -542,12 +2907,17 @@ static int ciopfs_unlink(const char *path)
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	dir_lock(p);
 	enter_user_context_effective();
 	int res = unlink(p);
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	if (res == 0)
+		namelog_forget(p);
+	cache_invalidate(p);
+	dir_unlock(p);
+	arena_reset();
 	return res;
 }
 
@@ -556,12 +2926,17 @@ static int ciopfs_rmdir(const char *path)
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	dir_lock(p);
 	enter_user_context_effective();
 	int res = rmdir(p);
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	if (res == 0)
+		namelog_forget(p);
+	cache_invalidate(p);
+	dir_unlock(p);
+	arena_reset();
 	return res;
 }
 
@@ -570,6 +2945,7 @@ static int ciopfs_symlink(const char *from, const char *to)
 	char *t = map_path(to);
 	if (unlikely(t == NULL))
 		return -ENOMEM;
+	dir_lock(t);
 	enter_user_context_effective();
 	int res = symlink(from, t);
 	if (res == -1)
@@ -577,7 +2953,9 @@ static int ciopfs_symlink(const char *from, const char *to)
 	leave_user_context_effective();
 	if (res == 0)
 		ciopfs_set_orig_name_path(t, to);
-	free(t);
+	cache_invalidate(t);
+	dir_unlock(t);
+	arena_reset();
 	return res;
 }
 
@@ -585,17 +2963,35 @@ static int ciopfs_rename(const char *from, const char *to)
 {
 	char *f = map_path(from);
 	char *t = map_path(to);
-	if (unlikely(f == NULL || t == NULL))
+	if (unlikely(f == NULL || t == NULL)) {
+		arena_reset();
 		return -ENOMEM;
+	}
+	dir_lock2(f, t);
+	namelog_rename_begin();
 	enter_user_context_effective();
 	int res = rename(f, t);
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
+	/* renaming a directory moves all cached entries and pending names
+	 * below it */
+	if (res == 0 && (attr_cache || xattr_cache || snapshot_index || dir_cache ||
+	    namelog_pending)) {
+		struct stat st;
+		namelog_forget(f);
+		if (lstat(t, &st) == -1 || S_ISDIR(st.st_mode)) {
+			namelog_rename(f, t);
+			cache_invalidate_all();
+		}
+	}
+	namelog_rename_end();
 	if (res == 0)
 		ciopfs_set_orig_name_path(t, to);
-	free(f);
-	free(t);
+	cache_invalidate(f);
+	cache_invalidate(t);
+	dir_unlock2(f, t);
+	arena_reset();
 	return res;
 }
 
@@ -603,8 +2999,11 @@ static int ciopfs_link(const char *from, const char *to)
 {
 	char *f = map_path(from);
 	char *t = map_path(to);
-	if (unlikely(f == NULL || t == NULL))
+	if (unlikely(f == NULL || t == NULL)) {
+		arena_reset();
 		return -ENOMEM;
+	}
+	dir_lock(t);
 	enter_user_context_effective();
 	int res = link(f, t);
 	if (res == -1)
@@ -612,8 +3011,11 @@ static int ciopfs_link(const char *from, const char *to)
 	leave_user_context_effective();
 	if (res == 0)
 		ciopfs_set_orig_name_path(t, to);
-	free(f);
-	free(t);
+	/* the link count of the source changed as well */
+	cache_invalidate(f);
+	cache_invalidate(t);
+	dir_unlock(t);
+	arena_reset();
 	return res;
 }
 
@@ -627,7 +3029,8 @@ static int ciopfs_chmod(const char *path, mode_t mode)
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	arena_reset();
 	return res;
 }
 
@@ -641,7 +3044,8 @@ static int ciopfs_chown(const char *path, uid_t uid, gid_t gid)
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	arena_reset();
 	return res;
 }
 
@@ -655,7 +3059,8 @@ static int ciopfs_truncate(const char *path, off_t size)
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	arena_reset();
 	return res;
 }
 
@@ -666,6 +3071,8 @@ static int ciopfs_ftruncate(const char *path, off_t size, struct fuse_file_info
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
+	cache_invalidate_attr(path);
+	arena_reset();
 	return res;
 }
 
@@ -674,37 +3081,38 @@ static int ciopfs_utimens(const char *path, const struct timespec ts[2])
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
-
-	struct timeval tv[2];
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
 	enter_user_context_effective();
-	int res = utimes(p, tv);
+	/* unlike utimes(2) this keeps nanosecond precision and supports UTIME_OMIT
+	 * which is used to only update one of the timestamps */
+	int res = utimensat(AT_FDCWD, p, ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	arena_reset();
 	return res;
 }
 
 static int ciopfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	int ret;
+	bool created;
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	dir_lock(p);
 	enter_user_context_effective();
-	int fd = open(p, fi->flags, mode);
+	int fd = open_create(p, fi->flags, mode, &created);
 	if (fd == -1)
 		ret = -errno;
 	leave_user_context_effective();
-	free(p);
+	if (fd != -1 && created)
+		ciopfs_set_orig_name_fd(fd, path);
+	cache_invalidate(p);
+	dir_unlock(p);
+	arena_reset();
 	if (fd == -1)
 		return ret;
-	ciopfs_set_orig_name_fd(fd, path);
 	fi->fh = fd;
 	return 0;
 }
@@ -712,38 +3120,94 @@ static int ciopfs_create(const char *path, mode_t mode, struct fuse_file_info *f
 static int ciopfs_open(const char *path, struct fuse_file_info *fi)
 {
 	int ret;
+	bool created = false;
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	if (fi->flags & O_CREAT)
+		dir_lock(p);
 	enter_user_context_effective();
-	int fd = open(p, fi->flags);
+	int fd;
+	if (fi->flags & O_CREAT)
+		fd = open_create(p, fi->flags, 0666, &created);
+	else
+		fd = open(p, fi->flags);
 	if (fd == -1)
 		ret = -errno;
 	leave_user_context_effective();
-	free(p);
+	if (fd != -1 && created)
+		ciopfs_set_orig_name_fd(fd, path);
+	if (fi->flags & (O_CREAT | O_TRUNC))
+		cache_invalidate(p);
+	if (fi->flags & O_CREAT)
+		dir_unlock(p);
+	arena_reset();
 	if (fd == -1)
 		return ret;
-	if (fi->flags & O_CREAT)
-		ciopfs_set_orig_name_fd(fd, path);
 	fi->fh = fd;
 	return 0;
 }
 
+/* At most `-o data_threads=' worker threads read, write or sync file data
+ * at the same time. The fuse library starts another worker whenever all
+ * of them are busy, requests for metadata thus don't queue up behind a
+ * bulk transfer in the backing store or for the CPU, the data requests
+ * wait here instead.
+ */
+static unsigned int data_threads;
+static sem_t data_sem;
+
+/* observed by the background request tuning, see bg_tune() */
+static bool autotune;
+static uint64_t data_busy_ns, data_ops;
+static __thread struct timespec data_start;
+
+static inline void data_enter(void)
+{
+	if (unlikely(!arena.buf))
+		thread_init();
+	if (data_threads)
+		while (sem_wait(&data_sem) == -1 && errno == EINTR);
+	if (__atomic_load_n(&autotune, __ATOMIC_RELAXED))
+		clock_gettime(CLOCK_MONOTONIC, &data_start);
+}
+
+static inline void data_leave(void)
+{
+	if (__atomic_load_n(&autotune, __ATOMIC_RELAXED)) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		__atomic_add_fetch(&data_busy_ns, (now.tv_sec - data_start.tv_sec) * 1000000000ULL +
+		                   now.tv_nsec - data_start.tv_nsec, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&data_ops, 1, __ATOMIC_RELAXED);
+	}
+	if (data_threads)
+		sem_post(&data_sem);
+}
+
 static int ciopfs_read(const char *path, char *buf, size_t size, off_t offset,
                        struct fuse_file_info *fi)
 {
+	data_enter();
 	int res = pread(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
+	data_leave();
 	return res;
 }
 
 static int ciopfs_write(const char *path, const char *buf, size_t size,
                         off_t offset, struct fuse_file_info *fi)
 {
+	data_enter();
 	int res = pwrite(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
+	data_leave();
+	if (attr_cache) {
+		cache_invalidate_attr(path);
+		arena_reset();
+	}
 	return res;
 }
 
@@ -757,7 +3221,7 @@ static int ciopfs_statfs(const char *path, struct statvfs *stbuf)
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	arena_reset();
 	return res;
 }
 
@@ -784,6 +3248,7 @@ static int ciopfs_release(const char *path, struct fuse_file_info *fi)
 static int ciopfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
 	int res;
+	data_enter();
 #ifdef HAVE_FDATASYNC
 	if (isdatasync)
 		res = fdatasync(fi->fh);
@@ -791,31 +3256,42 @@ static int ciopfs_fsync(const char *path, int isdatasync, struct fuse_file_info
 #endif
 		res = fsync(fi->fh);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	data_leave();
+	return res;
 }
 
 static int ciopfs_access(const char *path, int mode)
 {
+	struct stat st;
+	int res;
   	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	/* the cache can only answer whether a file exists, permission checks
+	 * would have to take supplementary groups and ACLs into account */
+	if (mode == F_OK && attr_cache_get(p, &st, &res)) {
+		arena_reset();
+		return res;
+	}
 	enter_user_context_real();
-  	int res = access(p, mode);
+  	res = access(p, mode);
 	if (res == -1)
 		res = -errno;
 	leave_user_context_real();
-	free(p);
+	arena_reset();
 	return res;
 }
 
 static int ciopfs_setxattr(const char *path, const char *name, const char *value,
                            size_t size, int flags)
 {
-	if (!strcmp(name, CIOPFS_ATTR_NAME)) {
-		debug("denying setting value of extended attribute '%s'\n", CIOPFS_ATTR_NAME);
+	if (!strcmp(name, CIOPFS_ATTR_NAME) || !strcmp(name, CIOPFS_CLEAN_ATTR_NAME)) {
+		debug("denying setting value of extended attribute '%s'\n", name);
 		return -EPERM;
 	}
+	if (nocaps && !strcmp(name, "security.capability"))
+		return -ENOTSUP;
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
@@ -824,42 +3300,148 @@ static int ciopfs_setxattr(const char *path, const char *name, const char *value
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	arena_reset();
 	return res;
 }
 
+/* Reports usage statistics of the various caches in the same way as
+ * snprintf(3), they are readable through the CIOPFS_STATS_ATTR_NAME
+ * extended attribute of the mount point.
+ */
+static int ciopfs_stats(char *buf, size_t size)
+{
+	struct hashmap *caches[] = {
+		fold_cache, attr_cache, xattr_cache, dir_cache, namelog_pending,
+		snapshot_index,
+	};
+	struct hashmap_stats stats;
+	size_t i;
+	int len = 0;
+
+	for (i = 0; i < sizeof(caches) / sizeof(caches[0]); i++) {
+		if (!caches[i])
+			continue;
+		hashmap_stats(caches[i], &stats);
+		len += snprintf(buf + len, len < size ? size - len : 0,
+		                "%s: entries=%zu bytes=%zu hits=%lu misses=%lu evictions=%lu\n",
+		                caches[i]->name, stats.entries, stats.bytes, stats.hits,
+		                stats.misses, stats.evictions);
+	}
+	if (cache_pool)
+		len += snprintf(buf + len, len < size ? size - len : 0,
+		                "cache_mem: used=%zu limit=%zu\n",
+		                __atomic_load_n(&cache_pool->used, __ATOMIC_RELAXED),
+		                cache_pool->limit);
+	return len;
+}
+
 static int ciopfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+	if (!strcmp(path, "/") && !strcmp(name, CIOPFS_STATS_ATTR_NAME)) {
+		char buf[1024];
+		int len = ciopfs_stats(buf, sizeof buf);
+		if (len >= sizeof buf)
+			len = sizeof(buf) - 1;
+		if (size == 0)
+			return len;
+		if (size < len)
+			return -ERANGE;
+		memcpy(value, buf, len);
+		return len;
+	}
+	if (nocaps && !strcmp(name, "security.capability"))
+		return -ENOTSUP;
+	ssize_t res;
+	unsigned long gen = cache_gen();
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	if (xattr_cache_get(p, name, value, size, &res, NULL)) {
+		arena_reset();
+		return res;
+	}
 	enter_user_context_effective();
-	int res = lgetxattr(p, name, value, size);
+	res = lgetxattr(p, name, value, size);
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	if (size || res < 0)
+		xattr_cache_put(p, name, value, res, gen);
+	arena_reset();
 	return res;
 }
 
+/* Removes CIOPFS_ATTR_NAME and CIOPFS_CLEAN_ATTR_NAME from a list of attribute
+ * names as returned by llistxattr(2) and returns the new length of the list.
+ * Otherwise tools which preserve extended attributes would try to copy them
+ * and fail.
+ */
+static ssize_t ciopfs_filter_xattr_list(char *list, ssize_t len)
+{
+	char *s = list, *end = list + len;
+	size_t n;
+	while (s < end) {
+		n = strnlen(s, end - s) + 1;
+		if ((n == sizeof(CIOPFS_ATTR_NAME) && !memcmp(s, CIOPFS_ATTR_NAME, n)) ||
+		    (n == sizeof(CIOPFS_CLEAN_ATTR_NAME) && !memcmp(s, CIOPFS_CLEAN_ATTR_NAME, n))) {
+			memmove(s, s + n, end - s - n);
+			end -= n;
+			len -= n;
+		} else
+			s += n;
+	}
+	return len;
+}
+
+/* The name list is cached along with the attribute values under the
+ * empty name which can't clash with a real attribute.
+ */
 static int ciopfs_listxattr(const char *path, char *list, size_t size)
 {
+	ssize_t res, len;
+	char *buf = list;
+	unsigned long gen = cache_gen();
 	char *p = map_path(path);
 	if (unlikely(p == NULL))
 		return -ENOMEM;
+	if (xattr_cache_get(p, "", list, size, &res, NULL))
+		goto out;
 	enter_user_context_effective();
-	int res = llistxattr(p, list, size);
+	/* try to list directly into the supplied buffer, this only fails if
+	 * it can't hold our internal attribute or the caller just wants to
+	 * know the size */
+	res = size ? llistxattr(p, list, size) : -1;
+	if (res == -1 && (!size || errno == ERANGE)) {
+		/* retry if an attribute was added in the meantime */
+		do {
+			if ((len = llistxattr(p, NULL, 0)) == -1 ||
+			    !(buf = arena_alloc(len + 1)))
+				break;
+			res = llistxattr(p, buf, len);
+		} while (res == -1 && errno == ERANGE);
+	}
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	if (res >= 0)
+		res = ciopfs_filter_xattr_list(buf, res);
+	xattr_cache_put(p, "", buf, res, gen);
+	if (buf != list && res > 0 && size) {
+		if (size < res)
+			res = -ERANGE;
+		else
+			memcpy(list, buf, res);
+	}
+out:
+	arena_reset();
 	return res;
 }
 
 static int ciopfs_removexattr(const char *path, const char *name)
 {
-	if (!strcmp(name, CIOPFS_ATTR_NAME)) {
-		debug("denying removal of extended attribute '%s'\n", CIOPFS_ATTR_NAME);
+	if (!strcmp(name, CIOPFS_ATTR_NAME) || !strcmp(name, CIOPFS_CLEAN_ATTR_NAME)) {
+		debug("denying removal of extended attribute '%s'\n", name);
 		return -EPERM;
 	}
 	char *p = map_path(path);
@@ -870,7 +3452,8 @@ static int ciopfs_removexattr(const char *path, const char *name)
 	if (res == -1)
 		res = -errno;
 	leave_user_context_effective();
-	free(p);
+	cache_invalidate(p);
+	arena_reset();
 	return res;
 }
 
@@ -881,6 +3464,370 @@ static int ciopfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
 			   sizeof(fi->lock_owner));
 }
 
+/* Prewarming of caches at mount time (`-o prewarm=GLOB[:GLOB...]').
+ *
+ * The directories matching the given patterns are walked in the
+ * background by PREWARM_THREADS threads. For every entry the original
+ * name, the folded path components and the attributes are looked up,
+ * which fills whatever caches are enabled as well as the dentry and
+ * inode caches of the underlying file system. Regular files up to the
+ * size given by `-o prewarm_readahead=' are read ahead into the page
+ * cache. The walker threads run with idle CPU and I/O priority,
+ * requests served on behalf of the file system users thus take
+ * precedence.
+ */
+
+#define PREWARM_THREADS 4
+
+struct prewarm_dir {
+	struct prewarm_dir *next;
+	char *orig;        /* original path as seen through ciopfs */
+	char path[];       /* folded path within the source directory */
+};
+
+static char *prewarm_globs;
+static size_t prewarm_readahead_size;
+static pthread_t prewarm_threads[PREWARM_THREADS];
+static int prewarm_nthreads;
+static pthread_mutex_t prewarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prewarm_cond = PTHREAD_COND_INITIALIZER;
+static struct prewarm_dir *prewarm_stack;
+static int prewarm_busy;
+static bool prewarm_stop, prewarm_done;
+static unsigned long prewarm_entries;
+
+static void prewarm_push(const char *path, const char *orig)
+{
+	size_t len = strlen(path) + 1;
+	struct prewarm_dir *d = malloc(sizeof(*d) + len + strlen(orig) + 1);
+	if (!d)
+		return;
+	memcpy(d->path, path, len);
+	d->orig = strcpy(d->path + len, orig);
+	pthread_mutex_lock(&prewarm_mutex);
+	d->next = prewarm_stack;
+	prewarm_stack = d;
+	pthread_cond_signal(&prewarm_cond);
+	pthread_mutex_unlock(&prewarm_mutex);
+}
+
+/* looks up everything about the entry name of the directory d */
+static void prewarm_entry(struct prewarm_dir *d, const char *name)
+{
+	char path[PATH_MAX], orig[PATH_MAX], attrbuf[FILENAME_MAX];
+	const char *origname = name;
+	unsigned long gen = cache_gen();
+	struct stat st;
+	int res, fd;
+
+	if (child_path(path, sizeof path, d->path, name) >= sizeof path)
+		return;
+	if (ciopfs_get_orig_name(path, attrbuf, sizeof attrbuf, NULL) > 0 &&
+	    ciopfs_orig_name_matches(attrbuf, name))
+		origname = attrbuf;
+	if (snprintf(orig, sizeof orig, "%s/%s", d->orig, origname) >= sizeof orig)
+		return;
+	/* fills the fold cache */
+	map_path(orig);
+	res = lstat(path, &st) == -1 ? -errno : 0;
+	attr_cache_put(path, &st, res, gen);
+	if (res)
+		return;
+	if (S_ISDIR(st.st_mode)) {
+		prewarm_push(path, orig);
+	} else if (S_ISREG(st.st_mode) && prewarm_readahead_size &&
+	           st.st_size <= prewarm_readahead_size &&
+	           (fd = open(path, O_RDONLY)) != -1) {
+#ifdef __linux__
+		readahead(fd, 0, st.st_size);
+#else
+		posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#endif
+		close(fd);
+	}
+	__atomic_fetch_add(&prewarm_entries, 1, __ATOMIC_RELAXED);
+}
+
+static void prewarm_walk(struct prewarm_dir *d)
+{
+	struct dirent *de;
+	DIR *dp = opendir(d->path);
+	if (!dp)
+		return;
+	while (!prewarm_stop && (de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		    !name_is_folded(de->d_name))
+			continue;
+		prewarm_entry(d, de->d_name);
+		arena_reset();
+	}
+	closedir(dp);
+}
+
+static void *prewarm_thread(void *arg)
+{
+	struct prewarm_dir *d;
+	thread_set_idle();
+	pthread_mutex_lock(&prewarm_mutex);
+	for (;;) {
+		while (!prewarm_stack && prewarm_busy && !prewarm_stop)
+			pthread_cond_wait(&prewarm_cond, &prewarm_mutex);
+		if (!prewarm_stack || prewarm_stop)
+			break;
+		d = prewarm_stack;
+		prewarm_stack = d->next;
+		prewarm_busy++;
+		pthread_mutex_unlock(&prewarm_mutex);
+		prewarm_walk(d);
+		free(d);
+		pthread_mutex_lock(&prewarm_mutex);
+		prewarm_busy--;
+	}
+	/* wake up the others once all work is done */
+	pthread_cond_broadcast(&prewarm_cond);
+	if (!prewarm_stop && !prewarm_done) {
+		prewarm_done = true;
+		log_print("prewarm: done after %lu entries\n", prewarm_entries);
+	}
+	pthread_mutex_unlock(&prewarm_mutex);
+	arena_reset();
+	return NULL;
+}
+
+/* reconstructs the original path of the folded path p */
+static void prewarm_orig_path(const char *p, char *orig, size_t size)
+{
+	char path[PATH_MAX], attrbuf[FILENAME_MAX];
+	const char *name;
+	char *s;
+	size_t len = 0;
+
+	orig[0] = '\0';
+	if (!strcmp(p, ".") || strlen(p) >= sizeof path)
+		return;
+	strcpy(path, p);
+	for (name = path; name; name = s ? s + 1 : NULL) {
+		if ((s = strchr(name, '/')))
+			*s = '\0';
+		if (ciopfs_get_orig_name(path, attrbuf, sizeof attrbuf, NULL) <= 0 ||
+		    !ciopfs_orig_name_matches(attrbuf, name))
+			strcpy(attrbuf, name);
+		len += snprintf(orig + len, len < size ? size - len : 0, "/%s", attrbuf);
+		if (s)
+			*s = '/';
+	}
+}
+
+/* starts walking all directories which match one of the patterns */
+static void prewarm_start(void)
+{
+	char *globs, *pattern, *save, fold[PATH_MAX];
+	glob_t g;
+	size_t i;
+
+	if (!prewarm_globs || !(globs = strdup(prewarm_globs)))
+		return;
+	for (pattern = strtok_r(globs, ":", &save); pattern; pattern = strtok_r(NULL, ":", &save)) {
+		while (*pattern == '/')
+			pattern++;
+		/* the patterns are matched against the folded names */
+		if (!*pattern)
+			pattern = ".";
+		if (fold_name(pattern, fold, sizeof fold, NULL) >= sizeof fold ||
+		    glob(fold, GLOB_NOSORT | GLOB_ONLYDIR, NULL, &g))
+			continue;
+		for (i = 0; i < g.gl_pathc; i++) {
+			char orig[PATH_MAX];
+			prewarm_orig_path(g.gl_pathv[i], orig, sizeof orig);
+			prewarm_push(g.gl_pathv[i], orig);
+		}
+		globfree(&g);
+	}
+	free(globs);
+	arena_reset();
+	for (i = 0; i < PREWARM_THREADS; i++) {
+		if (pthread_create(&prewarm_threads[i], NULL, prewarm_thread, NULL))
+			break;
+	}
+	prewarm_nthreads = i;
+}
+
+static void prewarm_destroy(void)
+{
+	struct prewarm_dir *d;
+	int i;
+	pthread_mutex_lock(&prewarm_mutex);
+	prewarm_stop = true;
+	pthread_cond_broadcast(&prewarm_cond);
+	pthread_mutex_unlock(&prewarm_mutex);
+	for (i = 0; i < prewarm_nthreads; i++)
+		pthread_join(prewarm_threads[i], NULL);
+	while ((d = prewarm_stack)) {
+		prewarm_stack = d->next;
+		free(d);
+	}
+}
+
+/* Tuning of the kernel limits for background requests (`-o autotune').
+ *
+ * Readahead and writeback requests are sent asynchronously, the kernel
+ * keeps at most max_background of them outstanding and considers the
+ * connection congested above congestion_threshold. Its defaults of 12
+ * and 9 don't exploit backing stores which serve many requests in
+ * parallel. Once per BG_TUNE_INTERVAL the average number of data requests
+ * in flight and their mean latency are derived from the last interval,
+ * their quotient is the throughput. While the limit is nearly exhausted
+ * it is doubled for an interval and kept only if the throughput rose by
+ * a tenth, otherwise the next attempt is made after BG_TUNE_HOLD
+ * intervals. If the latency doubles without a gain in throughput the
+ * backing store got slower and the limit is lowered by a quarter.
+ *
+ * The values are written to the fuse control file system, which has to
+ * be mounted at /sys/fs/fuse/connections. `-o max_background=' and
+ * `-o congestion_threshold=' fix the respective value instead.
+ */
+
+#define BG_TUNE_INTERVAL 1 /* seconds */
+#define BG_TUNE_HOLD 30
+#define BG_MIN 12
+#define BG_MAX 1024
+
+struct bg_tuner {
+	unsigned int max_background;
+	unsigned int probe;  /* previous limit while a larger one is tried */
+	unsigned int hold;   /* intervals until the next try */
+	double rate, latency;/* when the current limit was accepted */
+};
+
+static unsigned int max_background, congestion_threshold;
+static char *mountpoint;
+static pthread_t bg_tuner_thread;
+static bool bg_tuner_running, bg_tuner_stop;
+static pthread_mutex_t bg_tuner_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bg_tuner_cond = PTHREAD_COND_INITIALIZER;
+
+/* returns the new limit given the average number of requests in flight
+ * and their mean latency in seconds during the last interval */
+static unsigned int bg_tune(struct bg_tuner *t, double inflight, double latency)
+{
+	unsigned int bg = t->max_background;
+	double rate;
+
+	if (latency <= 0)
+		return bg;
+	rate = inflight / latency;
+	if (t->hold)
+		t->hold--;
+	if (t->probe) {
+		/* keep the larger limit only if it paid off */
+		if (rate < 1.1 * t->rate) {
+			bg = t->probe;
+			t->hold = BG_TUNE_HOLD;
+		} else {
+			t->rate = rate;
+			t->latency = latency;
+		}
+		t->probe = 0;
+	} else if (t->latency && latency > 2 * t->latency && rate < 1.1 * t->rate) {
+		/* keep backing off until the latency recovers */
+		bg = bg - bg / 4 < BG_MIN ? BG_MIN : bg - bg / 4;
+		t->rate = rate;
+	} else if (inflight > 0.75 * bg && bg < BG_MAX && !t->hold) {
+		t->probe = bg;
+		t->rate = rate;
+		t->latency = latency;
+		bg = 2 * bg > BG_MAX ? BG_MAX : 2 * bg;
+	} else if (!t->latency) {
+		t->rate = rate;
+		t->latency = latency;
+	}
+	return t->max_background = bg;
+}
+
+static bool bg_tune_write(unsigned int conn, const char *name, unsigned int value)
+{
+	char path[PATH_MAX], buf[16];
+	int fd, len = snprintf(buf, sizeof buf, "%u\n", value);
+	bool ok;
+	snprintf(path, sizeof path, "/sys/fs/fuse/connections/%u/%s", conn, name);
+	if ((fd = open(path, O_WRONLY)) == -1)
+		return false;
+	ok = write(fd, buf, len) == len;
+	close(fd);
+	return ok;
+}
+
+static void *bg_tune_thread(void *arg)
+{
+	struct bg_tuner t = { .max_background = max_background ? max_background : BG_MIN };
+	unsigned int conn = 0, bg, written = 0;
+	bool tuning = false;
+	uint64_t busy, ops;
+	struct timespec deadline;
+	struct stat st;
+
+	pthread_mutex_lock(&bg_tuner_mutex);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += BG_TUNE_INTERVAL;
+	while (!bg_tuner_stop) {
+		if (pthread_cond_timedwait(&bg_tuner_cond, &bg_tuner_mutex, &deadline) != ETIMEDOUT)
+			continue;
+		deadline.tv_sec += BG_TUNE_INTERVAL;
+		busy = __atomic_exchange_n(&data_busy_ns, 0, __ATOMIC_RELAXED);
+		ops = __atomic_exchange_n(&data_ops, 0, __ATOMIC_RELAXED);
+		/* the mount is only complete once requests are served */
+		if (!conn) {
+			if (stat(mountpoint, &st))
+				continue;
+			/* the kernel names connections by its own encoding of the device */
+			conn = major(st.st_dev) << 20 | minor(st.st_dev);
+		}
+		bg = max_background ? max_background :
+		     bg_tune(&t, busy / (BG_TUNE_INTERVAL * 1e9), ops ? busy / 1e9 / ops : 0);
+		if (bg == written)
+			continue;
+		written = bg;
+		if ((!max_background && !bg_tune_write(conn, "max_background", bg)) ||
+		    (!congestion_threshold &&
+		     !bg_tune_write(conn, "congestion_threshold", bg * 3 / 4))) {
+			log_print("autotune: could not write to /sys/fs/fuse/connections/%u: %s, "
+			          "autotune disabled\n", conn, strerror(errno));
+			__atomic_store_n(&autotune, false, __ATOMIC_RELAXED);
+			break;
+		}
+		if (!tuning) {
+			log_print("autotune: tuning /sys/fs/fuse/connections/%u\n", conn);
+			tuning = true;
+		}
+		debug("autotune: max_background %u\n", bg);
+	}
+	pthread_mutex_unlock(&bg_tuner_mutex);
+	return NULL;
+}
+
+static void bg_tune_start(void)
+{
+	if (!autotune)
+		return;
+	if (!mountpoint || (max_background && congestion_threshold) ||
+	    pthread_create(&bg_tuner_thread, NULL, bg_tune_thread, NULL)) {
+		autotune = false;
+		return;
+	}
+	bg_tuner_running = true;
+}
+
+static void bg_tune_destroy(void)
+{
+	if (!bg_tuner_running)
+		return;
+	pthread_mutex_lock(&bg_tuner_mutex);
+	bg_tuner_stop = true;
+	pthread_cond_signal(&bg_tuner_cond);
+	pthread_mutex_unlock(&bg_tuner_mutex);
+	pthread_join(bg_tuner_thread, NULL);
+}
+
 static void *ciopfs_init(struct fuse_conn_info *conn)
 {
 	if (chdir(dirname) == -1) {
@@ -892,9 +3839,83 @@ static void *ciopfs_init(struct fuse_conn_info *conn)
 		log_print("warning underlying filesystem does not support extended attributes, "
 		          "converting all filenames to lower case\n");
 
+	if (!affinity_init())
+		log_print("warning could not set up thread affinity\n");
+
+	dir_locks_init();
+
+	if (!fold_cache_init()) {
+		log_print("warning could not allocate fold cache\n");
+		fold_cache_size = 0;
+	}
+
+	if (!attr_cache_init())
+		log_print("warning could not allocate attribute caches\n");
+
+	if (!dir_cache_init())
+		log_print("warning could not allocate directory cache\n");
+
+	if (snapshot_file)
+		snapshot_load();
+
+	/* the caches are only used concurrently once the first thread runs */
+	if (cache_mem && (cache_pool = hashmap_pool_new(cache_mem))) {
+		hashmap_pool_add(cache_pool, fold_cache);
+		hashmap_pool_add(cache_pool, attr_cache);
+		hashmap_pool_add(cache_pool, xattr_cache);
+		hashmap_pool_add(cache_pool, dir_cache);
+		hashmap_pool_add(cache_pool, snapshot_index);
+		hashmap_pool_add(cache_pool, snapshot_dirs);
+	}
+
+	if (!namelog_init()) {
+		log_print("namelog: %s: %s\n", namelog_file, strerror(errno));
+		exit(1);
+	}
+
+	if (!bloom_init())
+		log_print("bloom: %s: %s\n", bloom_file, strerror(errno));
+
+	if (data_threads && sem_init(&data_sem, 0, data_threads)) {
+		log_print("warning could not limit data threads: %s\n", strerror(errno));
+		data_threads = 0;
+	}
+
+	prewarm_start();
+
+#if FUSE_VERSION >= 29
+	if (max_background)
+		conn->max_background = max_background;
+	if (congestion_threshold)
+		conn->congestion_threshold = congestion_threshold;
+#else
+	if (max_background || congestion_threshold)
+		log_print("warning setting background request limits requires fuse 2.9\n");
+#endif
+	bg_tune_start();
+
+#ifdef FUSE_CAP_BIG_WRITES
+	/* without big writes the kernel splits every write request into
+	 * single pages, max_write was already limited by the library to
+	 * the size of its receive buffer and can be lowered with the
+	 * `-o max_write=' option.
+	 */
+	if (conn->capable & FUSE_CAP_BIG_WRITES)
+		conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+
 	return NULL;
 }
 
+static void ciopfs_destroy(void *data)
+{
+	bg_tune_destroy();
+	prewarm_destroy();
+	bloom_destroy();
+	namelog_destroy();
+	snapshot_save();
+}
+
 struct fuse_operations ciopfs_operations = {
 	.getattr	= ciopfs_getattr,
 	.fgetattr	= ciopfs_fgetattr,
@@ -928,7 +3949,11 @@ struct fuse_operations ciopfs_operations = {
 	.listxattr	= ciopfs_listxattr,
 	.removexattr	= ciopfs_removexattr,
 	.lock		= ciopfs_lock,
-	.init		= ciopfs_init
+	.init		= ciopfs_init,
+	.destroy	= ciopfs_destroy,
+#if FUSE_VERSION >= 29
+	.flag_utime_omit_ok = 1,
+#endif
 };
 
 static void usage(const char *name)
@@ -941,10 +3966,67 @@ static void usage(const char *name)
 			"    -o opt,[opt...]        mount options\n"
 			"    -h|--help              print help\n"
 			"       --version           print version\n"
+			"\n"
+			"ciopfs options:\n"
+			"    -o fold_cache=SIZE     memory used to cache folded path components\n"
+			"    -o cache_mem=SIZE      memory shared by all caches\n"
+			"    -o dir_cache=SIZE      memory used to cache directory listings\n"
+			"    -o nfc                 normalize names to NFC before folding them\n"
+			"    -o fold=POLICY         case folding policy: ascii, simple or full\n"
+			"    -o attr_cache=SECS     cache attributes of files for SECS seconds\n"
+			"    -o negative_cache=SECS cache non existing files for SECS seconds\n"
+			"    -o xattr_cache=SECS    cache extended attributes for SECS seconds\n"
+			"    -o nocaps              don't support security.capability attributes\n"
+			"    -o dirflags            flag directories without mixed case names\n"
+			"    -o namelog=FILE        log original names to FILE with group commit\n"
+			"    -o snapshot=FILE       keep original names in FILE across mounts\n"
+			"    -o bloom=FILE          keep a filter of inodes with mixed case names in FILE\n"
+			"    -o bloom_size=SIZE     size of the filter, rounded down to a power of two\n"
+			"    -o data_threads=N      read and write with at most N threads at once\n"
+			"    -o affinity=cpu|node   pin worker threads to CPUs or NUMA nodes\n"
+			"    -o autotune            adapt max_background to the backing store\n"
+			"    -o max_background=N    allow N outstanding background requests\n"
+			"    -o congestion_threshold=N\n"
+			"                           consider the mount congested above N requests\n"
+			"    -o prewarm=GLOB[:GLOB] walk matching directories at mount time\n"
+			"    -o prewarm_readahead=SIZE\n"
+			"                           read ahead files up to SIZE while prewarming\n"
 			"\n", name);
 
 }
 
+/* parses a size in bytes with an optional k, m or g suffix */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t size = strtoull(s, &end, 10);
+	switch (*end) {
+		case 'g':
+		case 'G':
+			size *= 1024;
+			/* fall through */
+		case 'm':
+		case 'M':
+			size *= 1024;
+			/* fall through */
+		case 'k':
+		case 'K':
+			size *= 1024;
+	}
+	return size;
+}
+
+/* the working directory changes once we are daemonized */
+static char *absolute_path(const char *path)
+{
+	char cwd[PATH_MAX], *s;
+	if (path[0] == '/' || !getcwd(cwd, sizeof cwd))
+		return strdup(path);
+	if (asprintf(&s, "%s/%s", cwd, path) == -1)
+		return NULL;
+	return s;
+}
+
 enum {
 	CIOPFS_OPT_HELP,
 	CIOPFS_OPT_VERSION
@@ -963,6 +4045,9 @@ static int ciopfs_opt_parse(void *data, const char *arg, int key, struct fuse_ar
 				}
 				return 0;
 			}
+			/* the mount point, needed to find the connection */
+			if (!mountpoint)
+				mountpoint = realpath(arg, NULL);
 			return 1;
 		case FUSE_OPT_KEY_OPT:
 			if (arg[0] == '-') {
@@ -972,13 +4057,95 @@ static int ciopfs_opt_parse(void *data, const char *arg, int key, struct fuse_ar
 						dolog = stderr_print;
 				}
 			} else if (!strcmp("allow_other", arg)) {
-				/* disable multithreaded mode if the file system
-				 * is accessible to multiple users simultanousely
-				 * because we can't store uid/gid per thread and
-				 * this leads to all sorts of race conditions and
-				 * security issues.
+				/* serve requests with the credentials of the
+				 * calling user if the file system is accessible
+				 * to multiple users simultaneously.
 				 */
-				single_threaded = (getuid() == 0);
+				multi_user = (getuid() == 0);
+			} else if (!strncmp("fold=", arg, 5)) {
+				if (!(fold_ops = fold_policy(arg + 5))) {
+					fprintf(stderr, "%s: unsupported folding policy `%s'\n",
+					        outargs->argv[0], arg + 5);
+					exit(1);
+				}
+				return 0;
+			} else if (!strcmp("nfc", arg)) {
+				normalize_nfc = true;
+				return 0;
+			} else if (!strncmp("dir_cache=", arg, 10)) {
+				dir_cache_size = parse_size(arg + 10);
+				return 0;
+			} else if (!strncmp("cache_mem=", arg, 10)) {
+				cache_mem = parse_size(arg + 10);
+				return 0;
+			} else if (!strncmp("fold_cache=", arg, 11)) {
+				fold_cache_size = parse_size(arg + 11);
+				return 0;
+			} else if (!strncmp("attr_cache=", arg, 11)) {
+				attr_cache_ttl = atof(arg + 11);
+				return 0;
+			} else if (!strncmp("negative_cache=", arg, 15)) {
+				negative_cache_ttl = atof(arg + 15);
+				return 0;
+			} else if (!strncmp("xattr_cache=", arg, 12)) {
+				xattr_cache_ttl = atof(arg + 12);
+				return 0;
+			} else if (!strcmp("nocaps", arg)) {
+				nocaps = true;
+				return 0;
+			} else if (!strcmp("dirflags", arg)) {
+				dirflags = true;
+				return 0;
+			} else if (!strncmp("namelog=", arg, 8)) {
+				if (!(namelog_file = absolute_path(arg + 8))) {
+					perror(outargs->argv[0]);
+					exit(1);
+				}
+				return 0;
+			} else if (!strncmp("affinity=", arg, 9)) {
+				if (!strcmp(arg + 9, "cpu"))
+					affinity = AFFINITY_CPU;
+				else if (!strcmp(arg + 9, "node"))
+					affinity = AFFINITY_NODE;
+				else {
+					fprintf(stderr, "%s: unsupported affinity `%s'\n",
+					        outargs->argv[0], arg + 9);
+					exit(1);
+				}
+				return 0;
+			} else if (!strcmp("autotune", arg)) {
+				autotune = true;
+				return 0;
+			} else if (!strncmp("max_background=", arg, 15)) {
+				max_background = atoi(arg + 15);
+				return 0;
+			} else if (!strncmp("congestion_threshold=", arg, 21)) {
+				congestion_threshold = atoi(arg + 21);
+				return 0;
+			} else if (!strncmp("data_threads=", arg, 13)) {
+				data_threads = atoi(arg + 13);
+				return 0;
+			} else if (!strncmp("prewarm=", arg, 8)) {
+				prewarm_globs = strdup(arg + 8);
+				return 0;
+			} else if (!strncmp("prewarm_readahead=", arg, 18)) {
+				prewarm_readahead_size = parse_size(arg + 18);
+				return 0;
+			} else if (!strncmp("bloom=", arg, 6)) {
+				if (!(bloom_file = absolute_path(arg + 6))) {
+					perror(outargs->argv[0]);
+					exit(1);
+				}
+				return 0;
+			} else if (!strncmp("bloom_size=", arg, 11)) {
+				bloom_size = parse_size(arg + 11);
+				return 0;
+			} else if (!strncmp("snapshot=", arg, 9)) {
+				if (!(snapshot_file = absolute_path(arg + 9))) {
+					perror(outargs->argv[0]);
+					exit(1);
+				}
+				return 0;
 			}
 			return 1;
 		case CIOPFS_OPT_HELP:
@@ -1008,12 +4175,23 @@ int main(int argc, char *argv[])
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	fuse_opt_parse(&args, &dirname, ciopfs_opts, ciopfs_opt_parse);
 
-	if (single_threaded) {
+	if (!fold_ops)
+		fold_ops = fold_policy(NULL);
+	if (normalize_nfc && !(nfc_ops = fold_ops->nfc ? fold_ops : fold_policy("full"))) {
+		fprintf(stderr, "%s: unicode normalization is not supported\n", argv[0]);
+		return 1;
+	}
+	if (fold_cache_size == FOLD_CACHE_AUTO)
+		fold_cache_size = fold_ops == &ascii_fold_ops ? 0 : 512 * 1024;
+
+#ifndef PER_THREAD_CREDENTIALS
+	if (multi_user) {
 		fuse_opt_add_arg(&args, "-s");
 		log_print("disabling multithreaded mode for root mounted "
 		          "filesystem that is accessible for other users "
 		          "via the `-o allow_other' option\n");
 	}
+#endif
 
 	umask(0);
 	return fuse_main(args.argc, args.argv, &ciopfs_operations, NULL);
@@ -20,7 +20,10 @@ LDFLAGS_GLIB = $(shell pkg-config --libs glib-2.0)
 CFLAGS_ICU  = -DHAVE_LIBICUUC
 LDFLAGS_ICU = -licuuc
 
-# unicode flags set this to either {C,LD}FLAGS_GLIB or {C,LD}FLAGS_ICU
+# unicode flags set this to {C,LD}FLAGS_GLIB and/or {C,LD}FLAGS_ICU, the
+# ascii folding policy is always built in. libicu provides the simple and
+# full policies, glib only full. If both are enabled glib is used for full
+# and remains the default, as it was before the policies were selectable.
 CFLAGS_UNICODE  = ${CFLAGS_GLIB}
 LDFLAGS_UNICODE = ${LDFLAGS_GLIB}
 
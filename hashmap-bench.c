@@ -0,0 +1,111 @@
+/*
+ * Microbenchmark and sanity check of the concurrent hash map used by the
+ * ciopfs caches, run it with `make bench'.
+ *
+ * The checks cover the per map budget, the shared pool, deletion and
+ * clearing, the program exits with a non zero status if one of them
+ * fails. Afterwards lookups of random keys are timed with an increasing
+ * number of threads.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "hashmap.c"
+
+#define KEYS 100000
+#define OPS 2000000
+#define MAX_THREADS 64
+
+static struct hashmap *map;
+static int failed;
+
+static void check(bool ok, const char *what)
+{
+	printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed = 1;
+}
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *reader(void *arg)
+{
+	char value[64];
+	unsigned int r = (uintptr_t)arg * 7919 + 1;
+	int i, key;
+	for (i = 0; i < OPS; i++) {
+		r = r * 1103515245 + 12345;
+		key = r % KEYS;
+		hashmap_get(map, &key, sizeof key, value, sizeof value);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	struct hashmap *a, *b;
+	struct hashmap_pool *pool;
+	struct hashmap_stats st, st2;
+	pthread_t threads[MAX_THREADS];
+	char value[64];
+	int i, n;
+
+	a = hashmap_new("budget", 64 * 1024);
+	for (i = 0; i < KEYS; i++)
+		hashmap_put(a, &i, sizeof i, "valuevaluevalue", 15);
+	hashmap_stats(a, &st);
+	check(st.bytes <= 64 * 1024 && st.evictions > 0, "budget is enforced");
+	i = KEYS - 1;
+	check(hashmap_get(a, &i, sizeof i, value, sizeof value) == 15, "recent entry survives eviction");
+	hashmap_del(a, &i, sizeof i);
+	check(hashmap_get(a, &i, sizeof i, value, sizeof value) == -1, "deleted entry is gone");
+	hashmap_clear(a);
+	hashmap_stats(a, &st);
+	check(st.entries == 0, "clear empties the map");
+
+	/* a map which is used keeps more of the pool than an idle one */
+	pool = hashmap_pool_new(256 * 1024);
+	b = hashmap_new("idle", 0);
+	hashmap_pool_add(pool, a);
+	hashmap_pool_add(pool, b);
+	for (i = 0; i < KEYS; i++)
+		hashmap_put(b, &i, sizeof i, "valuevaluevalue", 15);
+	for (i = 0; i < KEYS; i++) {
+		int key = i % 1000;
+		hashmap_put(a, &i, sizeof i, "valuevaluevalue", 15);
+		hashmap_get(a, &key, sizeof key, value, sizeof value);
+	}
+	hashmap_stats(a, &st);
+	hashmap_stats(b, &st2);
+	check(pool->used <= pool->limit + 64 * hashmap_entry_size(sizeof i, 15),
+	      "pool limit is enforced");
+	check(st.bytes + st2.bytes == pool->used, "pool accounting matches the maps");
+	check(st.bytes > st2.bytes, "pool favours the busy map");
+
+	map = hashmap_new("bench", 0);
+	for (i = 0; i < KEYS; i++)
+		hashmap_put(map, &i, sizeof i, "0123456789abcdef0123456789abcdef", 32);
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		double t = now();
+		for (i = 0; i < n; i++)
+			pthread_create(&threads[i], NULL, reader, (void *)(uintptr_t)i);
+		for (i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		t = now() - t;
+		printf("%2d threads: %6.1f Mlookups/s\n", n, n * (double)OPS / t / 1e6);
+	}
+	return failed;
+}
@@ -0,0 +1,368 @@
+/* Concurrent hash map used by all caches.
+ *
+ * The map is split into stripes, each of which has its own read/write
+ * lock, bucket array and memory accounting. Lookups only take the read
+ * lock of one stripe which lets them scale with the number of threads.
+ *
+ * Keys and values are arbitrary byte strings which are copied in and out
+ * of the map, callers never hold references to entries. Once a stripe
+ * exceeds its share of the memory budget entries are evicted following
+ * the CLOCK algorithm: every lookup marks an entry as referenced, the
+ * clock hand sweeps over the entries of the stripe and evicts the first
+ * one which wasn't referenced since the last sweep.
+ *
+ * Maps can also share a global memory budget through a pool. Once the
+ * pool exceeds its limit a second clock hand sweeps over the stripes of
+ * all maps in the pool and evicts from each in turn, frequently used
+ * maps thus keep more memory than rarely used ones.
+ */
+
+#define HASHMAP_STRIPES 64
+
+struct hashmap_entry {
+	struct hashmap_entry *next;                    /* bucket chain */
+	struct hashmap_entry *clock_next, *clock_prev; /* clock ring */
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t len;
+	char referenced;
+	char data[];                                   /* key followed by value */
+};
+
+struct hashmap_stripe {
+	pthread_rwlock_t lock;
+	struct hashmap_entry **buckets;
+	size_t nbuckets;
+	size_t entries;
+	size_t bytes;
+	struct hashmap_entry *hand;
+	unsigned long hits, misses, evictions;
+} __attribute__((aligned(64)));
+
+#define HASHMAP_POOL_MAPS 8
+
+struct hashmap_pool {
+	size_t limit;  /* in bytes */
+	size_t used;
+	unsigned int hand;
+	int nmaps;
+	struct hashmap *maps[HASHMAP_POOL_MAPS];
+};
+
+struct hashmap {
+	const char *name;
+	size_t budget; /* in bytes, 0 means unlimited */
+	struct hashmap_pool *pool;
+	struct hashmap_stripe stripes[HASHMAP_STRIPES];
+};
+
+static inline uint32_t hash_bytes(const char *s, size_t len)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static inline size_t hashmap_entry_size(size_t keylen, size_t len)
+{
+	return sizeof(struct hashmap_entry) + keylen + len;
+}
+
+static struct hashmap *hashmap_new(const char *name, size_t budget)
+{
+	int i;
+	struct hashmap *map = calloc(1, sizeof(*map));
+	if (!map)
+		return NULL;
+	map->name = name;
+	map->budget = budget;
+	for (i = 0; i < HASHMAP_STRIPES; i++)
+		pthread_rwlock_init(&map->stripes[i].lock, NULL);
+	return map;
+}
+
+static struct hashmap_pool *hashmap_pool_new(size_t limit)
+{
+	struct hashmap_pool *pool = calloc(1, sizeof(*pool));
+	if (pool)
+		pool->limit = limit;
+	return pool;
+}
+
+/* Adds a map to the pool, its own budget no longer applies. Must be called
+ * before the map is used concurrently.
+ */
+static bool hashmap_pool_add(struct hashmap_pool *pool, struct hashmap *map)
+{
+	int i;
+	if (!map || pool->nmaps == HASHMAP_POOL_MAPS)
+		return false;
+	map->budget = 0;
+	map->pool = pool;
+	for (i = 0; i < HASHMAP_STRIPES; i++)
+		pool->used += map->stripes[i].bytes;
+	pool->maps[pool->nmaps++] = map;
+	return true;
+}
+
+/* accounts for size bytes more (or less if negative) in the stripe */
+static inline void hashmap_account(struct hashmap *map, struct hashmap_stripe *st,
+                                   ssize_t size)
+{
+	st->bytes += size;
+	if (map->pool)
+		__atomic_fetch_add(&map->pool->used, size, __ATOMIC_RELAXED);
+}
+
+static inline struct hashmap_stripe *hashmap_stripe(struct hashmap *map, uint32_t hash)
+{
+	/* the low bits select the bucket within the stripe */
+	return &map->stripes[(hash >> 24) % HASHMAP_STRIPES];
+}
+
+/* must be called with the stripe lock held */
+static struct hashmap_entry **hashmap_find(struct hashmap_stripe *st, uint32_t hash,
+                                           const void *key, size_t keylen)
+{
+	struct hashmap_entry **e;
+	if (!st->nbuckets)
+		return NULL;
+	for (e = &st->buckets[hash & (st->nbuckets - 1)]; *e; e = &(*e)->next) {
+		if ((*e)->hash == hash && (*e)->keylen == keylen &&
+		    !memcmp((*e)->data, key, keylen))
+			return e;
+	}
+	return NULL;
+}
+
+/* removes the entry *e from its bucket chain and the clock ring */
+static void hashmap_unlink(struct hashmap *map, struct hashmap_stripe *st,
+                           struct hashmap_entry **e)
+{
+	struct hashmap_entry *entry = *e;
+	*e = entry->next;
+	if (entry->clock_next == entry) {
+		st->hand = NULL;
+	} else {
+		entry->clock_prev->clock_next = entry->clock_next;
+		entry->clock_next->clock_prev = entry->clock_prev;
+		if (st->hand == entry)
+			st->hand = entry->clock_next;
+	}
+	st->entries--;
+	hashmap_account(map, st, -(ssize_t)hashmap_entry_size(entry->keylen, entry->len));
+	free(entry);
+}
+
+static void hashmap_grow(struct hashmap *map, struct hashmap_stripe *st)
+{
+	size_t i, n = st->nbuckets ? st->nbuckets * 2 : 16;
+	struct hashmap_entry *e, *next, **buckets = calloc(n, sizeof(*buckets));
+	if (!buckets)
+		return;
+	for (i = 0; i < st->nbuckets; i++) {
+		for (e = st->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (n - 1)];
+			buckets[e->hash & (n - 1)] = e;
+		}
+	}
+	free(st->buckets);
+	hashmap_account(map, st, (n - st->nbuckets) * sizeof(*buckets));
+	st->buckets = buckets;
+	st->nbuckets = n;
+}
+
+/* evicts entries until the stripe uses at most limit bytes or the pool
+ * is within its limit, whichever comes first */
+static void hashmap_evict(struct hashmap *map, struct hashmap_stripe *st, size_t limit)
+{
+	struct hashmap_entry *e, **prev;
+	struct hashmap_pool *pool = map->pool;
+	while (st->bytes > limit && (e = st->hand) &&
+	       (!pool || __atomic_load_n(&pool->used, __ATOMIC_RELAXED) > pool->limit)) {
+		st->hand = e->clock_next;
+		if (e->referenced) {
+			e->referenced = 0;
+			continue;
+		}
+		for (prev = &st->buckets[e->hash & (st->nbuckets - 1)]; *prev != e;
+		     prev = &(*prev)->next);
+		hashmap_unlink(map, st, prev);
+		st->evictions++;
+	}
+}
+
+/* Evicts entries from the maps of the pool until it is within its limit.
+ * Every stripe is visited at most twice, which is enough for the clock
+ * to evict something from each unless all entries were just inserted.
+ */
+static void hashmap_pool_evict(struct hashmap_pool *pool)
+{
+	unsigned int i, n = 2 * pool->nmaps * HASHMAP_STRIPES;
+	for (i = 0; i < n && __atomic_load_n(&pool->used, __ATOMIC_RELAXED) > pool->limit; i++) {
+		unsigned int hand = __atomic_fetch_add(&pool->hand, 1, __ATOMIC_RELAXED);
+		struct hashmap *map = pool->maps[hand / HASHMAP_STRIPES % pool->nmaps];
+		struct hashmap_stripe *st = &map->stripes[hand % HASHMAP_STRIPES];
+		/* a stripe gives up its share of the excess, at least one entry */
+		size_t excess = __atomic_load_n(&pool->used, __ATOMIC_RELAXED) - pool->limit;
+		size_t share = excess / (pool->nmaps * HASHMAP_STRIPES) + 1;
+		pthread_rwlock_wrlock(&st->lock);
+		hashmap_evict(map, st, st->bytes > share ? st->bytes - share : 0);
+		pthread_rwlock_unlock(&st->lock);
+	}
+}
+
+/* Copies the value stored under key into value which is size bytes large.
+ * Returns the length of the stored value which might be larger than size
+ * or -1 if there is no such entry.
+ */
+static ssize_t hashmap_get(struct hashmap *map, const void *key, size_t keylen,
+                           void *value, size_t size)
+{
+	uint32_t hash = hash_bytes(key, keylen);
+	struct hashmap_stripe *st = hashmap_stripe(map, hash);
+	struct hashmap_entry **e;
+	ssize_t len = -1;
+
+	pthread_rwlock_rdlock(&st->lock);
+	if ((e = hashmap_find(st, hash, key, keylen))) {
+		len = (*e)->len;
+		memcpy(value, (*e)->data + keylen, len < size ? len : size);
+		if (!(*e)->referenced)
+			__atomic_store_n(&(*e)->referenced, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->hits, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&st->misses, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&st->lock);
+	return len;
+}
+
+/* Stores a copy of value under key, replacing any previous entry */
+static bool hashmap_put(struct hashmap *map, const void *key, size_t keylen,
+                        const void *value, size_t len)
+{
+	uint32_t hash = hash_bytes(key, keylen);
+	struct hashmap_stripe *st = hashmap_stripe(map, hash);
+	size_t size = hashmap_entry_size(keylen, len);
+	struct hashmap_entry **e, *entry;
+
+	if ((map->budget && size > map->budget / HASHMAP_STRIPES) ||
+	    (map->pool && size > map->pool->limit / HASHMAP_STRIPES))
+		return false;
+	if (!(entry = malloc(size)))
+		return false;
+	entry->hash = hash;
+	entry->keylen = keylen;
+	entry->len = len;
+	entry->referenced = 0;
+	memcpy(entry->data, key, keylen);
+	memcpy(entry->data + keylen, value, len);
+
+	pthread_rwlock_wrlock(&st->lock);
+	if ((e = hashmap_find(st, hash, key, keylen)))
+		hashmap_unlink(map, st, e);
+	if (st->entries >= st->nbuckets)
+		hashmap_grow(map, st);
+	if (!st->nbuckets) {
+		pthread_rwlock_unlock(&st->lock);
+		free(entry);
+		return false;
+	}
+	entry->next = st->buckets[hash & (st->nbuckets - 1)];
+	st->buckets[hash & (st->nbuckets - 1)] = entry;
+	/* insert behind the hand, making it the last one to be considered */
+	if (st->hand) {
+		entry->clock_next = st->hand;
+		entry->clock_prev = st->hand->clock_prev;
+		entry->clock_prev->clock_next = entry;
+		st->hand->clock_prev = entry;
+	} else {
+		entry->clock_next = entry->clock_prev = entry;
+		st->hand = entry;
+	}
+	st->entries++;
+	hashmap_account(map, st, size);
+	if (map->budget)
+		hashmap_evict(map, st, map->budget / HASHMAP_STRIPES);
+	pthread_rwlock_unlock(&st->lock);
+	if (map->pool && __atomic_load_n(&map->pool->used, __ATOMIC_RELAXED) > map->pool->limit)
+		hashmap_pool_evict(map->pool);
+	return true;
+}
+
+static void hashmap_del(struct hashmap *map, const void *key, size_t keylen)
+{
+	uint32_t hash = hash_bytes(key, keylen);
+	struct hashmap_stripe *st = hashmap_stripe(map, hash);
+	struct hashmap_entry **e;
+
+	pthread_rwlock_wrlock(&st->lock);
+	if ((e = hashmap_find(st, hash, key, keylen)))
+		hashmap_unlink(map, st, e);
+	pthread_rwlock_unlock(&st->lock);
+}
+
+static void hashmap_clear(struct hashmap *map)
+{
+	int i;
+	for (i = 0; i < HASHMAP_STRIPES; i++) {
+		struct hashmap_stripe *st = &map->stripes[i];
+		pthread_rwlock_wrlock(&st->lock);
+		while (st->hand) {
+			struct hashmap_entry **e;
+			for (e = &st->buckets[st->hand->hash & (st->nbuckets - 1)];
+			     *e != st->hand; e = &(*e)->next);
+			hashmap_unlink(map, st, e);
+		}
+		pthread_rwlock_unlock(&st->lock);
+	}
+}
+
+struct hashmap_stats {
+	size_t entries, bytes;
+	unsigned long hits, misses, evictions;
+};
+
+static void hashmap_stats(struct hashmap *map, struct hashmap_stats *stats)
+{
+	int i;
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < HASHMAP_STRIPES; i++) {
+		struct hashmap_stripe *st = &map->stripes[i];
+		pthread_rwlock_rdlock(&st->lock);
+		stats->entries += st->entries;
+		stats->bytes += st->bytes;
+		stats->hits += st->hits;
+		stats->misses += st->misses;
+		stats->evictions += st->evictions;
+		pthread_rwlock_unlock(&st->lock);
+	}
+}
+
+/* Calls fn for every entry of the map. The stripe the entry belongs to is
+ * locked for reading, fn must thus not modify the map.
+ */
+static void hashmap_foreach(struct hashmap *map,
+                            void (*fn)(const void *key, size_t keylen,
+                                       const void *value, size_t len, void *arg),
+                            void *arg)
+{
+	int i;
+	struct hashmap_entry *e;
+	for (i = 0; i < HASHMAP_STRIPES; i++) {
+		struct hashmap_stripe *st = &map->stripes[i];
+		pthread_rwlock_rdlock(&st->lock);
+		if ((e = st->hand)) {
+			do {
+				fn(e->data, e->keylen, e->data + e->keylen, e->len, arg);
+			} while ((e = e->clock_next) != st->hand);
+		}
+		pthread_rwlock_unlock(&st->lock);
+	}
+}
@@ -48,12 +48,127 @@ test_image() {
 	umount -f mnt || die "couldn't umount $1 image"
 }
 
+# $1 => source directory, $2 => additional ciopfs options
+mount_ciopfs() {
+	mkdir -p "$1" ciopfs-mnt
+	"$CIOPFS" $CIOPFS_ARGS${2:+,$2} "$1" ciopfs-mnt &> "ciopfs-$1.log" &
+	CIOPFS_PID=$!
+	sleep 1
+	ps -p $CIOPFS_PID &> /dev/null
+}
+
+umount_ciopfs() {
+	fusermount -u ciopfs-mnt || umount -f ciopfs-mnt
+	wait $CIOPFS_PID
+}
+
+# $1 => name as passed to ciopfs, $2 => directory within the mount point,
+# lists it to check the name is visible
+expect_listed() {
+	ls "ciopfs-mnt/$2" | grep -qxF "$1"
+}
+
+# $1 => number of entries expected in the source directory $2
+expect_backing() {
+	[ `ls "$2" | wc -l` -eq $1 ]
+}
+
+# full case folding of these yields names which aren't in NFC, they have to
+# be listed nonetheless
+test_nfc() {
+	local iota=`printf '\316\220'` jcaron=`printf '\307\260'`
+	rm -rf nfc && mount_ciopfs nfc fold=full,nfc || {
+		echo "-o nfc not supported, skipping"
+		return
+	}
+	touch "ciopfs-mnt/$iota" "ciopfs-mnt/$jcaron" "ciopfs-mnt/Cafe`printf '\314\201'`" \
+		"ciopfs-mnt/CAF`printf '\303\211'`"
+	expect_listed "$iota" && expect_listed "$jcaron" ||
+	die "-o nfc: names with non NFC folded form not listed"
+	# both spellings of cafe refer to the same file
+	expect_backing 3 nfc || die "-o nfc: unexpected backing names"
+	umount_ciopfs
+}
+
+# $1 => folding policy, $2 => number of distinct files among the names below
+test_fold() {
+	local sz=`printf '\303\237'` ae=`printf '\303\244'` AE=`printf '\303\204'`
+	rm -rf "fold-$1" && mount_ciopfs "fold-$1" fold=$1 || {
+		echo "-o fold=$1 not supported, skipping"
+		return
+	}
+	touch ciopfs-mnt/Mixed ciopfs-mnt/MIXED "ciopfs-mnt/Stra${sz}e" ciopfs-mnt/STRASSE \
+		"ciopfs-mnt/${AE}rger" "ciopfs-mnt/${ae}rger"
+	expect_listed Mixed && expect_listed "Stra${sz}e" && expect_listed "${AE}rger" ||
+	die "-o fold=$1: original names not listed"
+	expect_backing $2 "fold-$1" || die "-o fold=$1: unexpected backing names"
+	[ -f ciopfs-mnt/mixed ] || die "-o fold=$1: lookup with different case failed"
+	umount_ciopfs
+}
+
+# names created shortly before ciopfs gets killed are only recorded in the
+# log, they have to be replayed on the next mount
+test_namelog() {
+	local i
+	rm -rf namelog namelog.log
+	mount_ciopfs namelog "namelog=$PWD/namelog.log" || die "ciopfs not running with -o namelog"
+	mkdir ciopfs-mnt/Dir
+	touch `seq -f 'ciopfs-mnt/Dir/File-%g' 2000`
+	kill -9 $CIOPFS_PID
+	wait $CIOPFS_PID
+	fusermount -u -z ciopfs-mnt || umount -l ciopfs-mnt
+	[ -s namelog.log ] || die "-o namelog: nothing logged"
+	mount_ciopfs namelog "namelog=$PWD/namelog.log" || die "-o namelog: replay failed"
+	[ `ls ciopfs-mnt/Dir | grep -c '^File-'` -eq 2000 ] ||
+	die "-o namelog: names lost after crash"
+	umount_ciopfs
+	for i in 1 1000 2000; do
+		getfattr -n $CIOPFS_XATTR_NAME "namelog/dir/file-$i" | grep -qF "\"File-$i\"" ||
+		die "-o namelog: name of file-$i not materialized"
+	done
+}
+
+# $1 => additional ciopfs options, listings are served from the snapshot and
+# the bloom filter of the previous mount
+test_remount() {
+	rm -rf remount remount.snap remount.bloom
+	mount_ciopfs remount || die
+	mkdir ciopfs-mnt/Dir
+	touch `seq -f 'ciopfs-mnt/Dir/Name-%g' 200` ciopfs-mnt/Dir/lower
+	umount_ciopfs
+	# listings of directories modified within the last second aren't kept
+	sleep 2
+	mount_ciopfs remount "$1" || die "ciopfs not running with -o $1"
+	[ `ls ciopfs-mnt/Dir | wc -l` -eq 201 ] || die "-o $1: unexpected listing"
+	umount_ciopfs
+	mount_ciopfs remount "$1" || die "-o $1: remount failed"
+	expect_listed Name-100 Dir && expect_listed lower Dir ||
+	die "-o $1: original names not listed after remount"
+	touch ciopfs-mnt/Dir/New-Name
+	umount_ciopfs
+	# changes made while ciopfs isn't running have to be noticed
+	mv remount/dir/lower remount/dir/other
+	mount_ciopfs remount "$1" || die "-o $1: remount failed"
+	expect_listed New-Name Dir && expect_listed other Dir && ! expect_listed lower Dir ||
+	die "-o $1: stale listing after remount"
+	umount_ciopfs
+}
+
 [ $# -eq 0 ] && die "specify a directory in which to run the testsuite in"
 
 [ ! -d "$1" ] && mkdir "$1"
 
 cd "$1" && rm -rf mnt ciopfs-mnt *.img *.result *.log && mkdir -p mnt ciopfs-mnt || die
 
+test_nfc
+test_fold ascii 5
+test_fold simple 4
+test_fold full 3
+test_namelog
+test_remount "snapshot=$PWD/remount.snap"
+test_remount "bloom=$PWD/remount.bloom"
+test_remount "snapshot=$PWD/remount.snap,bloom=$PWD/remount.bloom"
+
 [ ! -f fstest.tgz ] && wget "$FSTEST" -O fstest.tgz
 
 mkfs_image ext3 20 -F
@@ -1,16 +1,77 @@
 #include <glib.h>
 
-static inline bool str_contains_upper(const char *s)
+static size_t glib_fold(const char *s, char *dest, size_t size, int *flags)
 {
-	while (*s) {
-		if(g_unichar_isupper(g_utf8_get_char(s)))
-			return true;
-		s = g_utf8_next_char(s);
+	size_t len;
+	const char *t;
+	char *str = g_utf8_casefold(s, -1);
+	if (!str)
+		return (size_t)-1;
+	len = strlen(str);
+	if (len < size)
+		memcpy(dest, str, len + 1);
+	if (flags) {
+		*flags = strcmp(s, str) ? FOLD_CHANGED : 0;
+		for (t = s; *t; t = g_utf8_next_char(t)) {
+			if (g_unichar_isupper(g_utf8_get_char(t))) {
+				*flags |= FOLD_UPPER;
+				break;
+			}
+		}
 	}
-	return false;
+	g_free(str);
+	return len;
 }
 
-static inline char *str_fold(const char *s)
+static bool glib_is_folded(const char *s)
 {
-	return g_utf8_casefold(s, -1);
+	int flags;
+	const char *t;
+	for (t = s; *t; t++) {
+		if (*t & 0x80) {
+			/* casefold the remaining non ASCII part */
+			if (glib_fold(t, NULL, 0, &flags) == (size_t)-1)
+				return false;
+			return !(flags & FOLD_CHANGED);
+		}
+		if (*t >= 'A' && *t <= 'Z')
+			return false;
+	}
+	return true;
+}
+
+/* glib offers no quick check, only ASCII names take the fast path */
+static bool glib_is_nfc(const char *s)
+{
+	bool ret;
+	char *str;
+	const char *t;
+	for (t = s; *t && !(*t & 0x80); t++);
+	if (!*t)
+		return true;
+	str = g_utf8_normalize(s, -1, G_NORMALIZE_NFC);
+	ret = str && !strcmp(s, str);
+	g_free(str);
+	return ret;
 }
+
+static size_t glib_nfc(const char *s, char *dest, size_t size)
+{
+	size_t len;
+	char *str = g_utf8_normalize(s, -1, G_NORMALIZE_NFC);
+	if (!str)
+		return (size_t)-1;
+	len = strlen(str);
+	if (len < size)
+		memcpy(dest, str, len + 1);
+	g_free(str);
+	return len;
+}
+
+static const struct fold_ops glib_fold_ops = {
+	.name		= "full",
+	.is_folded	= glib_is_folded,
+	.fold		= glib_fold,
+	.is_nfc		= glib_is_nfc,
+	.nfc		= glib_nfc,
+};
@@ -1,78 +1,208 @@
 #include <unicode/ustring.h>
 #include <unicode/uchar.h>
+#include <unicode/utf8.h>
+#include <unicode/unorm2.h>
 
-static inline UChar *utf8_to_utf16(const char *str, int32_t *length)
+/* Case folding of a single code point, folding is context free which
+ * means that the result is the same as if the whole string were folded.
+ * Full case folding may expand a character and keeps the Turkic mapping
+ * of I used by earlier versions, simple case folding always maps it to
+ * exactly one other. Stores up to three UTF-16 code units in
+ * dest and returns their number.
+ */
+static inline int32_t fold_char(UChar32 c, UChar *dest, bool *changed, bool simple)
 {
-	UChar *ustr;
+	UChar src[2];
+	int32_t srclen = 0, len = 0;
 	UErrorCode status = U_ZERO_ERROR;
 
-	u_strFromUTF8(NULL, 0, length, str, -1, &status);
-	status = U_ZERO_ERROR;
-	(*length)++; /* for the NUL char */
-	ustr = malloc(sizeof(UChar) * (*length));
-	if (!ustr)
-		return NULL;
-	u_strFromUTF8(ustr, *length, NULL, str, -1, &status);
-	if (U_FAILURE(status)) {
-		free(ustr);
-		return NULL;
+	if (simple) {
+		UChar32 f = u_foldCase(c, U_FOLD_CASE_DEFAULT);
+		U16_APPEND_UNSAFE(dest, len, f);
+		*changed = f != c;
+		return len;
 	}
-	return ustr;
+
+	U16_APPEND_UNSAFE(src, srclen, c);
+	len = u_strFoldCase(dest, 3, src, srclen, U_FOLD_CASE_EXCLUDE_SPECIAL_I, &status);
+	if (U_FAILURE(status))
+		return -1;
+	*changed = len != srclen || memcmp(src, dest, len * sizeof(UChar));
+	return len;
 }
 
-static inline char *utf16_to_utf8(UChar *ustr, int32_t *length)
+static inline size_t icu_fold_common(const char *s, char *dest, size_t size,
+                                     int *flags, bool simple)
 {
-	char *str;
-	UErrorCode status = U_ZERO_ERROR;
+	const uint8_t *src = (const uint8_t *)s;
+	int32_t i = 0, j, n, length = strlen(s);
+	size_t len = 0;
+	UChar32 c;
+	UChar folded[3];
+	bool changed;
 
-	u_strToUTF8(NULL, 0, length, ustr, -1, &status);
-	status = U_ZERO_ERROR;
-	(*length)++; /* for the NUL char */
-	str = malloc(*length);
-	if (!str)
-		return NULL;
-	u_strToUTF8(str, *length, NULL, ustr, -1, &status);
-	if (U_FAILURE(status)) {
-		free(str);
-		return NULL;
+	if (flags)
+		*flags = 0;
+
+	while (i < length) {
+		/* ASCII fast path, except for 'I' which full folding maps to the
+		 * dotless i (U+0131) by U_FOLD_CASE_EXCLUDE_SPECIAL_I */
+		if (src[i] < 0x80 && (src[i] != 'I' || simple)) {
+			c = src[i++];
+			if (c >= 'A' && c <= 'Z') {
+				c += 'a' - 'A';
+				if (flags)
+					*flags |= FOLD_UPPER | FOLD_CHANGED;
+			}
+			if (len + 1 < size)
+				dest[len] = c;
+			len++;
+			continue;
+		}
+
+		U8_NEXT(src, i, length, c);
+		if (c < 0 || (n = fold_char(c, folded, &changed, simple)) < 0)
+			return (size_t)-1;
+		if (flags) {
+			if (u_isupper(c))
+				*flags |= FOLD_UPPER;
+			if (changed)
+				*flags |= FOLD_CHANGED;
+		}
+		for (j = 0; j < n; /* U16_NEXT post-increments */) {
+			U16_NEXT(folded, j, n, c);
+			if (len + U8_LENGTH(c) < size)
+				U8_APPEND_UNSAFE(dest, len, c);
+			else
+				len += U8_LENGTH(c);
+		}
 	}
-	return str;
+
+	if (len < size)
+		dest[len] = '\0';
+	return len;
 }
 
-static inline bool str_contains_upper(const char *s)
+static inline bool icu_is_folded_common(const char *s, bool simple)
 {
-	bool ret = false;
-	int32_t length, i;
+	const uint8_t *src = (const uint8_t *)s;
+	int32_t i = 0, length = strlen(s);
 	UChar32 c;
-	UChar *ustr = utf8_to_utf16(s, &length);
-	if (!ustr)
-		return true;
-	for (i = 0; i < length; /* U16_NEXT post-increments */) {
-		U16_NEXT(ustr, i, length, c);
-		if (u_isupper(c)) {
-			ret = true;
-			goto out;
+	UChar folded[3];
+	bool changed;
+
+	while (i < length) {
+		if (src[i] < 0x80) {
+			if (src[i] >= 'A' && src[i] <= 'Z')
+				return false;
+			i++;
+			continue;
 		}
+		U8_NEXT(src, i, length, c);
+		if (c < 0 || fold_char(c, folded, &changed, simple) < 0 || changed)
+			return false;
 	}
-out:
-	free(ustr);
-	return ret;
+	return true;
+}
+
+static size_t icu_fold(const char *s, char *dest, size_t size, int *flags)
+{
+	return icu_fold_common(s, dest, size, flags, false);
+}
+
+static bool icu_is_folded(const char *s)
+{
+	return icu_is_folded_common(s, false);
 }
 
-static inline char *str_fold(const char *s)
+static size_t icu_fold_simple(const char *s, char *dest, size_t size, int *flags)
 {
-	int32_t length;
-	char *str;
-	UChar *ustr;
+	return icu_fold_common(s, dest, size, flags, true);
+}
+
+static bool icu_is_folded_simple(const char *s)
+{
+	return icu_is_folded_common(s, true);
+}
+
+/* NFC quick check as described in UAX #15, code points below U+0300 are
+ * never affected by normalization which makes the common case cheap.
+ * Returns false if s is not or might not be in NFC.
+ */
+static bool icu_is_nfc(const char *s)
+{
+	const uint8_t *src = (const uint8_t *)s;
+	int32_t i = 0, length = strlen(s);
+	uint8_t cc, lastcc = 0;
+	UChar32 c;
+
+	while (i < length) {
+		if (src[i] < 0x80) {
+			i++;
+			lastcc = 0;
+			continue;
+		}
+		U8_NEXT(src, i, length, c);
+		if (c < 0)
+			return false;
+		if (c < 0x300) {
+			lastcc = 0;
+			continue;
+		}
+		cc = u_getCombiningClass(c);
+		if (cc && lastcc > cc)
+			return false;
+		if (u_getIntPropertyValue(c, UCHAR_NFC_QUICK_CHECK) != UNORM_YES)
+			return false;
+		lastcc = cc;
+	}
+	return true;
+}
+
+static size_t icu_nfc(const char *s, char *dest, size_t size)
+{
+	int32_t length, len;
+	size_t ret = (size_t)-1;
+	UChar *ustr, *nstr = NULL;
 	UErrorCode status = U_ZERO_ERROR;
+	const UNormalizer2 *nfc = unorm2_getNFCInstance(&status);
 
-	ustr = utf8_to_utf16(s, &length);
-	if (!ustr)
-		return NULL;
-	u_strFoldCase(ustr, length, ustr, length, U_FOLD_CASE_EXCLUDE_SPECIAL_I, &status);
 	if (U_FAILURE(status))
-		return NULL;
-	str = utf16_to_utf8(ustr, &length);
+		return ret;
+	u_strFromUTF8(NULL, 0, &length, s, -1, &status);
+	status = U_ZERO_ERROR;
+	if (!(ustr = malloc(sizeof(UChar) * (length + 1))))
+		return ret;
+	u_strFromUTF8(ustr, length + 1, NULL, s, -1, &status);
+	if (U_FAILURE(status))
+		goto out;
+	/* NFC expands a string by at most a factor of three */
+	if (!(nstr = malloc(sizeof(UChar) * length * 3)))
+		goto out;
+	len = unorm2_normalize(nfc, ustr, length, nstr, length * 3, &status);
+	if (U_FAILURE(status))
+		goto out;
+	u_strToUTF8(dest, size, &len, nstr, len, &status);
+	if (U_SUCCESS(status) || status == U_BUFFER_OVERFLOW_ERROR)
+		ret = len;
+out:
+	free(nstr);
 	free(ustr);
-	return str;
+	return ret;
 }
+
+static const struct fold_ops icu_fold_ops = {
+	.name		= "full",
+	.is_folded	= icu_is_folded,
+	.fold		= icu_fold,
+	.is_nfc		= icu_is_nfc,
+	.nfc		= icu_nfc,
+};
+
+static const struct fold_ops icu_simple_fold_ops = {
+	.name		= "simple",
+	.is_folded	= icu_is_folded_simple,
+	.fold		= icu_fold_simple,
+	.is_nfc		= icu_is_nfc,
+	.nfc		= icu_nfc,
+};